@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+// A fixed-size heap array whose storage starts on a cache line boundary.
+// Only meant for trivially copyable element types (pixels, depth values, vertex components).
+template <typename T>
+class AlignedBuffer
+{
+  static_assert(std::is_trivially_copyable_v<T>, "AlignedBuffer only holds trivially copyable types");
+
+public:
+  AlignedBuffer() = default;
+
+  explicit AlignedBuffer(std::size_t count)
+      : count(count), ptr(allocate(count))
+  {
+  }
+
+  AlignedBuffer(const AlignedBuffer &other)
+      : count(other.count), ptr(allocate(other.count))
+  {
+    if (count > 0)
+      {
+        std::memcpy(ptr, other.ptr, count*sizeof(T));
+      }
+  }
+
+  AlignedBuffer(AlignedBuffer &&other) noexcept
+      : count(other.count), ptr(other.ptr)
+  {
+    other.count = 0;
+    other.ptr = nullptr;
+  }
+
+  AlignedBuffer &operator=(AlignedBuffer other) noexcept
+  {
+    std::swap(count, other.count);
+    std::swap(ptr, other.ptr);
+    return *this;
+  }
+
+  ~AlignedBuffer()
+  {
+    ::operator delete[](ptr, std::align_val_t(CACHE_LINE_SIZE));
+  }
+
+  T *data() { return ptr; }
+  const T *data() const { return ptr; }
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T &operator[](std::size_t i) { return ptr[i]; }
+  const T &operator[](std::size_t i) const { return ptr[i]; }
+
+  T *begin() { return ptr; }
+  T *end() { return ptr + count; }
+  const T *begin() const { return ptr; }
+  const T *end() const { return ptr + count; }
+
+  void fill(const T &value)
+  {
+    std::fill(ptr, ptr + count, value);
+  }
+
+private:
+  static T *allocate(std::size_t count)
+  {
+    if (count == 0)
+      {
+        return nullptr;
+      }
+    // Round the allocation up to whole cache lines so that vector loops may touch the tail.
+    std::size_t bytes = (count*sizeof(T) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    return static_cast<T*>(::operator new[](bytes, std::align_val_t(CACHE_LINE_SIZE)));
+  }
+
+  std::size_t count = 0;
+  T *ptr = nullptr;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <QVector>
+#include <cstdint>
+
+// A read-only view of contiguous elements owned by someone else: a QVector, or a memory-mapped
+// file. It is only valid while the owner is alive and unchanged.
+template <typename T>
+class ArrayView
+{
+public:
+  ArrayView() = default;
+  ArrayView(const T *data, qsizetype size) : ptr(data), count(size) {}
+  ArrayView(const QVector<T> &vector) : ptr(vector.constData()), count(vector.size()) {}
+
+  const T *data() const { return ptr; }
+  qsizetype size() const { return count; }
+  bool isEmpty() const { return count == 0; }
+
+  const T &operator[](qsizetype i) const { return ptr[i]; }
+  ArrayView sliced(qsizetype pos, qsizetype n) const { return ArrayView(ptr + pos, n); }
+  const T *begin() const { return ptr; }
+  const T *end() const { return ptr + count; }
+
+private:
+  const T *ptr = nullptr;
+  qsizetype count = 0;
+};
+
+// Bits per index of an IndexView.
+enum class IndexFormat
+{
+  UInt16, // meshes with up to 65536 vertices
+  UInt32,
+};
+
+// A read-only view of indices stored as 16 or 32-bit integers. Both read as 32-bit ones.
+class IndexView
+{
+public:
+  IndexView() = default;
+  IndexView(ArrayView<uint16_t> indices) : ptr(indices.data()), count(indices.size()) {}
+  IndexView(ArrayView<uint32_t> indices)
+    : ptr(indices.data()), count(indices.size()), indexFormat(IndexFormat::UInt32) {}
+
+  const void *data() const { return ptr; }
+  qsizetype size() const { return count; }
+  bool isEmpty() const { return count == 0; }
+  IndexFormat format() const { return indexFormat; }
+  int bytesPerIndex() const { return indexFormat == IndexFormat::UInt16 ? 2 : 4; }
+
+  IndexView sliced(qsizetype pos, qsizetype n) const
+  {
+    IndexView view = *this;
+    view.ptr = static_cast<const char*>(ptr) + pos*bytesPerIndex();
+    view.count = n;
+    return view;
+  }
+
+  uint32_t operator[](qsizetype i) const
+  {
+    return indexFormat == IndexFormat::UInt16 ? static_cast<const uint16_t*>(ptr)[i]
+                                              : static_cast<const uint32_t*>(ptr)[i];
+  }
+
+private:
+  const void *ptr = nullptr;
+  qsizetype count = 0;
+  IndexFormat indexFormat = IndexFormat::UInt16;
+};
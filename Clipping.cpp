@@ -0,0 +1,123 @@
+#include "Clipping.h"
+
+#include <cmath>
+
+namespace Clipping
+{
+bool
+clipLine(int &ax, int &ay, int &bx, int &by, const rect &clip)
+{
+  unsigned codeA = outcode(ax, ay, clip);
+  unsigned codeB = outcode(bx, by, clip);
+  while (true)
+    {
+      if ((codeA | codeB) == 0)
+        {
+          return true;
+        }
+      if ((codeA & codeB) != 0)
+        {
+          return false; // both endpoints beyond the same edge
+        }
+
+      // Move an outside endpoint onto the edge it is beyond. The intersection is computed from
+      // the current endpoints, so it always lies between them.
+      unsigned code = codeA ? codeA : codeB;
+      double dx = bx - ax;
+      double dy = by - ay;
+      int x, y;
+      if (code & Top)
+        {
+          y = clip.maxy;
+          x = ax + std::lround(dx*(y - ay)/dy);
+        }
+      else if (code & Bottom)
+        {
+          y = clip.miny;
+          x = ax + std::lround(dx*(y - ay)/dy);
+        }
+      else if (code & Right)
+        {
+          x = clip.maxx;
+          y = ay + std::lround(dy*(x - ax)/dx);
+        }
+      else
+        {
+          x = clip.minx;
+          y = ay + std::lround(dy*(x - ax)/dx);
+        }
+
+      if (code == codeA)
+        {
+          ax = x;
+          ay = y;
+          codeA = outcode(ax, ay, clip);
+        }
+      else
+        {
+          bx = x;
+          by = y;
+          codeB = outcode(bx, by, clip);
+        }
+    }
+}
+
+namespace
+{
+// Keeps the part of the polygon where inside() holds. intersect() returns the point where the
+// edge from a to b crosses the boundary.
+template <typename Inside, typename Intersect>
+int clipEdge(const ClipVertex *in, int count, ClipVertex *out, Inside inside, Intersect intersect)
+{
+  int n = 0;
+  for (int i = 0; i < count; i++)
+    {
+      const ClipVertex &a = in[i];
+      const ClipVertex &b = in[(i + 1) % count];
+      bool aInside = inside(a);
+      bool bInside = inside(b);
+      if (aInside)
+        {
+          out[n++] = a;
+        }
+      if (aInside != bInside)
+        {
+          out[n++] = intersect(a, b);
+        }
+    }
+  return n;
+}
+
+ClipVertex lerp(const ClipVertex &a, const ClipVertex &b, float t)
+{
+  return {a.x + (b.x - a.x)*t, a.y + (b.y - a.y)*t, a.z + (b.z - a.z)*t,
+          {a.w[0] + (b.w[0] - a.w[0])*t, a.w[1] + (b.w[1] - a.w[1])*t, a.w[2] + (b.w[2] - a.w[2])*t}};
+}
+}
+
+int
+clipPolygon(ClipVertex *vertices, int count, float minx, float miny, float maxx, float maxy)
+{
+  ClipVertex temp[MAX_POLYGON_VERTICES];
+  auto atX = [](float x) {
+    return [x](const ClipVertex &a, const ClipVertex &b) {
+      ClipVertex v = lerp(a, b, (x - a.x)/(b.x - a.x));
+      v.x = x;
+      return v;
+    };
+  };
+  auto atY = [](float y) {
+    return [y](const ClipVertex &a, const ClipVertex &b) {
+      ClipVertex v = lerp(a, b, (y - a.y)/(b.y - a.y));
+      v.y = y;
+      return v;
+    };
+  };
+
+  count = clipEdge(vertices, count, temp, [&](const ClipVertex &v) { return v.x >= minx; }, atX(minx));
+  count = clipEdge(temp, count, vertices, [&](const ClipVertex &v) { return v.x <= maxx; }, atX(maxx));
+  count = clipEdge(vertices, count, temp, [&](const ClipVertex &v) { return v.y >= miny; }, atY(miny));
+  count = clipEdge(temp, count, vertices, [&](const ClipVertex &v) { return v.y <= maxy; }, atY(maxy));
+  return count;
+}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "FrameBuffer.h"
+
+#include <cmath>
+
+// Screen-space clipping.
+//
+// Triangles are not clipped to the screen: the rasterizers only walk the part of the bounding box
+// inside their clip rectangle, which is the cheapest way to handle partially visible triangles.
+// That only works while the integer edge functions can't overflow, so vertices must stay inside
+// a guard band around the screen. Triangles reaching outside it are clipped to it here.
+namespace Clipping
+{
+// Pixels beyond every screen edge that the rasterizers accept without clipping.
+constexpr int GUARD_BAND = 4096;
+
+enum Outcode : unsigned
+{
+  Left   = 1,
+  Right  = 2,
+  Bottom = 4,
+  Top    = 8,
+  OffScreen = Left | Right | Bottom | Top,
+  OutsideGuardBand = 16,
+};
+
+inline unsigned outcode(float x, float y, float minx, float miny, float maxx, float maxy)
+{
+  return (x < minx ? unsigned(Left) : 0) | (x > maxx ? unsigned(Right) : 0) | (y < miny ? unsigned(Bottom) : 0)
+         | (y > maxy ? unsigned(Top) : 0);
+}
+
+inline unsigned outcode(int x, int y, const rect &clip)
+{
+  return outcode(x, y, clip.minx, clip.miny, clip.maxx, clip.maxy);
+}
+
+// Cohen-Sutherland. Moves the endpoints onto clip and returns false when the line misses it.
+bool clipLine(int &ax, int &ay, int &bx, int &by, const rect &clip);
+
+// A vertex in screen units (pixels or sub-pixels), before rounding. w are its barycentric
+// weights in the triangle that was clipped, to interpolate the triangle's other attributes.
+struct ClipVertex
+{
+  float x, y, z;
+  float w[3];
+};
+
+// A triangle clipped by 4 edges has at most 7 vertices.
+constexpr int MAX_POLYGON_VERTICES = 7;
+
+// Sutherland-Hodgman clipping of a convex polygon to a rectangle, in place. vertices has room
+// for MAX_POLYGON_VERTICES. Returns the new number of vertices, less than 3 if nothing is left.
+// The winding is preserved, so the result can be drawn as a fan.
+int clipPolygon(ClipVertex *vertices, int count, float minx, float miny, float maxx, float maxy);
+
+inline point3 toPoint3(const ClipVertex &v)
+{
+  return {(int)std::floor(v.x + 0.5f), (int)std::floor(v.y + 0.5f), v.z};
+}
+
+inline vertex toVertex(const ClipVertex &v)
+{
+  return {(int)std::floor(v.x + 0.5f), (int)std::floor(v.y + 0.5f), v.z};
+}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QtGlobal>
+#include <algorithm>
+#include <cmath>
+
+// Storage format of a FrameBuffer's depth buffer.
+//
+// The rasterizers always work with depth in [0, 1] where larger is closer to the viewer; the
+// format decides how that is stored and compared.
+//   Unorm8, Unorm16:  round(z*max), greater-or-equal passes, cleared to 0.
+//   Float32:          1 - z, the conventional near = 0 layout, less-or-equal passes, cleared to 1.
+//   Float32Reversed:  z itself, near = 1, greater-or-equal passes, cleared to 0.
+enum class DepthFormat
+{
+  Unorm8,
+  Unorm16,
+  Float32,
+  Float32Reversed,
+};
+
+template <DepthFormat F>
+struct DepthTraits;
+
+template <>
+struct DepthTraits<DepthFormat::Unorm8>
+{
+  using Type = quint8;
+  static constexpr Type clearValue = 0;
+  static Type encode(float z) { return std::clamp((int)std::round(z*255), 0, 255); }
+  static float closeness(Type d) { return d/255.0f; }
+  template <typename T> static bool nearer(T a, T b) { return a > b; }
+};
+
+template <>
+struct DepthTraits<DepthFormat::Unorm16>
+{
+  using Type = quint16;
+  static constexpr Type clearValue = 0;
+  static Type encode(float z) { return std::clamp((int)std::round(z*65535), 0, 65535); }
+  static float closeness(Type d) { return d/65535.0f; }
+  template <typename T> static bool nearer(T a, T b) { return a > b; }
+};
+
+template <>
+struct DepthTraits<DepthFormat::Float32>
+{
+  using Type = float;
+  static constexpr Type clearValue = 1.0f;
+  static Type encode(float z) { return 1.0f - std::clamp(z, 0.0f, 1.0f); }
+  static float closeness(Type d) { return 1.0f - d; }
+  template <typename T> static bool nearer(T a, T b) { return a < b; }
+};
+
+template <>
+struct DepthTraits<DepthFormat::Float32Reversed>
+{
+  using Type = float;
+  static constexpr Type clearValue = 0.0f;
+  static Type encode(float z) { return std::clamp(z, 0.0f, 1.0f); }
+  static float closeness(Type d) { return d; }
+  template <typename T> static bool nearer(T a, T b) { return a > b; }
+};
+
+// The depth test of every format: an incoming value passes unless the stored one is nearer.
+template <DepthFormat F>
+inline bool depthPasses(typename DepthTraits<F>::Type incoming, typename DepthTraits<F>::Type stored)
+{
+  return !DepthTraits<F>::nearer(stored, incoming);
+}
+
+inline int depthFormatSize(DepthFormat format)
+{
+  switch (format)
+    {
+    case DepthFormat::Unorm8:          return 1;
+    case DepthFormat::Unorm16:         return 2;
+    case DepthFormat::Float32:
+    case DepthFormat::Float32Reversed: return 4;
+    }
+  return 4;
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "AlignedBuffer.h"
+#include "DepthFormat.h"
+
 #include <QPainter>
 //#include <QPixmap>
 #include <QImage>
+#include <cstring>
 
 struct point
 {
@@ -10,28 +14,98 @@ struct point
   int y;
 };
 
+// z is the depth in [0, 1], larger is closer.
 struct point3
 {
   int x;
   int y;
-  int z;
+  float z;
+};
+
+// Screen position in 28.4 fixed point (SUBPIXEL_BITS fractional bits), so the center of pixel
+// (x, y) is at (x*SUBPIXEL_ONE, y*SUBPIXEL_ONE). z is the depth in [0, 1], larger is closer.
+struct vertex
+{
+  int x;
+  int y;
+  float z;
 };
 
-// TODO: don't draw to a QImage, that is very slow becuase setPixelColor() does validations
-//       and probably isn't inlined.
+constexpr int SUBPIXEL_BITS = 4;
+constexpr int SUBPIXEL_ONE  = 1 << SUBPIXEL_BITS;
+
+// Inclusive pixel rectangle, in the same y-up coordinates as the rasterizers.
+struct rect
+{
+  int minx;
+  int miny;
+  int maxx;
+  int maxy;
+};
+
+// A pixel of the G-buffer of deferred shading: the triangle visible there, as an index into the
+// triangles of the draw, and its barycentric weights for their second and third vertices, in
+// 1/65535ths.
+struct GBufferTexel
+{
+  uint32_t triangle;
+  uint16_t u, v;
+};
+
+constexpr uint32_t NO_TRIANGLE = 0xffffffff;
+
+// The color and depth buffers are plain cache-line aligned arrays. Every row starts on a cache
+// line, and rows are stored top to bottom so that qimage() can wrap the memory directly. The
+// rasterizers use y-up coordinates, colorRow()/depthRow() do the flip.
+//
+// The depth buffer holds one DepthTraits<depthFormat()>::Type per pixel.
 class FrameBuffer
 {
 public:
-  FrameBuffer(int w, int h);
+  FrameBuffer(int w, int h, DepthFormat depthFormat = DepthFormat::Unorm16);
 
   void clear(QColor c);
-  const QImage &qimage() const;
-  const QImage &depthMap() const;
+  QImage qimage() const;
+  // A grayscale picture of the depth buffer, white is closest. It is converted on every call,
+  // so it costs nothing unless it is shown.
+  QImage depthMap() const;
   int width() const;
   int height() const;
+  rect bounds() const;
+  DepthFormat depthFormat() const;
 
   void clearDepthBuffer();
 
+  // Hierarchical depth: the farthest and nearest depth of every HIZ_BLOCK x HIZ_BLOCK block,
+  // used by triangle3z to reject or accept whole blocks. Enabled by default.
+  static constexpr int HIZ_BLOCK = 8;
+  void setHiZEnabled(bool enabled);
+  bool hiZEnabled() const;
+
+  // The G-buffer of deferred shading, allocated by enableGBuffer(). Every texel holds
+  // NO_TRIANGLE except where a deferred draw has written and not resolved yet.
+  void enableGBuffer();
+  bool hasGBuffer() const;
+
+  // Multisampling: a color and a depth value for each of samples() samples of every pixel,
+  // allocated by enableMultisampling() (4 or 8, or 1 to free them). A pixel's samples only hold
+  // values of their own once something was drawn into them, which its sample mask records; until
+  // then they are the pixel's color and depth. Clearing the color or the depth buffer clears the
+  // masks, so clearing costs a byte per pixel whatever the sample count. Changing the sample
+  // count resolves the whole buffer first and allocates the samples again, so it loses nothing
+  // drawn but isn't meant to happen every draw.
+  //
+  // resolveSamples() averages the samples of the pixels of clip that have any into their color,
+  // and stores the nearest of their depths, so that the color and depth buffers show the result.
+  // Their samples all hold values from then on: what is drawn into the color or depth buffer
+  // directly is overwritten by the next resolve of a multisampled draw over it.
+  void enableMultisampling(int samples);
+  int samples() const;
+  void resolveSamples(const rect &clip);
+
+  // triangle4, triangle6 and triangleFixed4x draw into 4 samples per pixel and resolve them
+  // right away. They enable multisampling with 4 samples, which on a buffer with 8 resolves its
+  // samples first (see above); the buffer keeps 4 afterwards.
   void set(int x, int y, QColor c);
   void line(int ax, int ay, int bx, int by, QColor c);
   void triangle(point p, point q, point r, QColor c);
@@ -41,10 +115,106 @@ public:
   void triangle4(point p, point q, point r, QColor c);
   void triangle5(point p, point q, point r, QColor c);
   void triangle6(point p, point q, point r, QColor c);
+  void triangle5simd(point p, point q, point r, QColor c);
+  void triangleFixed(vertex p, vertex q, vertex r, QColor c);
+  void triangleFixedZ(vertex p, vertex q, vertex r, QColor c);
+  void triangleFixed4x(vertex p, vertex q, vertex r, QColor c);
+  void triangleFixedDepth(vertex p, vertex q, vertex r);
   void scanline(int y, int xleft, int xright, QColor c);
 
+  // Same as above, but only the pixels inside clip are touched. These are what the tile binner
+  // calls, so that every worker stays inside its own tile. The multisampling ones need
+  // enableMultisampling(4) and leave resolving to the caller.
+  void triangle(point p, point q, point r, QColor c, const rect &clip);
+  void triangle2(point p, point q, point r, QColor c, const rect &clip);
+  void triangle3(point p, point q, point r, QColor c, const rect &clip);
+  void triangle3z(point3 p, point3 q, point3 r, QColor c, const rect &clip);
+  void triangle4(point p, point q, point r, QColor c, const rect &clip);
+  void triangle5(point p, point q, point r, QColor c, const rect &clip);
+  void triangle6(point p, point q, point r, QColor c, const rect &clip);
+  void triangle5simd(point p, point q, point r, QColor c, const rect &clip);
+  void triangleFixed(vertex p, vertex q, vertex r, QColor c, const rect &clip);
+  void triangleFixedZ(vertex p, vertex q, vertex r, QColor c, const rect &clip);
+  void triangleFixed4x(vertex p, vertex q, vertex r, QColor c, const rect &clip);
+  void triangleFixedDepth(vertex p, vertex q, vertex r, const rect &clip);
+
+  QRgb *colorRow(int y) { return colorData.data() + (h-1 - y)*colorPitch; }
+  const QRgb *colorRow(int y) const { return colorData.data() + (h-1 - y)*colorPitch; }
+  // T has to be the Type of the buffer's depth format.
+  template <typename T>
+  T *depthRow(int y) { return reinterpret_cast<T*>(depthData.data() + (h-1 - y)*depthPitch); }
+  template <typename T>
+  const T *depthRow(int y) const { return reinterpret_cast<const T*>(depthData.data() + (h-1 - y)*depthPitch); }
+  // From depthRow(y) to depthRow(y+1), in depth values.
+  std::ptrdiff_t depthRowStep() const { return -depthPitch/depthFormatSize(depthBufferFormat); }
+  GBufferTexel *gbufferRow(int y) { return gbufferData.data() + (h-1 - y)*gbufferPitch; }
+  // samples() values per pixel, the samples of a pixel next to each other.
+  QRgb *sampleColorRow(int y) { return sampleColorData.data() + (h-1 - y)*sampleColorPitch; }
+  template <typename T>
+  T *sampleDepthRow(int y) { return reinterpret_cast<T*>(sampleDepthData.data() + (h-1 - y)*sampleDepthPitch); }
+  // Bit s is set when sample s of the pixel holds a value of its own.
+  uint8_t *sampleMaskRow(int y) { return sampleMaskData.data() + (h-1 - y)*sampleMaskPitch; }
+  // For writers that only store the color of the samples in mask: gives them the pixel's depth
+  // before they are marked in the sample mask.
+  void copyDepthToSamples(int x, int y, unsigned mask)
+  {
+    int size = depthFormatSize(depthBufferFormat);
+    const uchar *pixel = depthData.data() + (h-1 - y)*depthPitch + x*size;
+    uchar *sample = sampleDepthData.data() + (h-1 - y)*sampleDepthPitch + x*sampleCount*size;
+    for (int s = 0; s < sampleCount; s++)
+      {
+        if (mask & (1u << s))
+          {
+            std::memcpy(sample + s*size, pixel, size);
+          }
+      }
+  }
+
+  // For depth writers outside this class, like the raster pipeline: depth up to nearestZ was
+  // written somewhere in box. Keeps the Hi-Z bounds valid.
+  void depthWritten(const rect &box, float nearestZ);
+
 private:
-  QImage frameBuffer;
-  QImage depthBuffer;
+  // Returns the number of pixels written.
+  int span(int y, int x1, int x2, QRgb c, const rect &clip);
+  template <DepthFormat F>
+  void triangle3z(const point3 &p, const point3 &q, const point3 &r, QRgb rgba,
+                  float area, const rect &box);
+  template <DepthFormat F>
+  void triangle3zHiZ(const point3 &p, const point3 &q, const point3 &r, QRgb rgba,
+                     float area, const rect &box);
+  template <DepthFormat F>
+  void clearDepthBuffer();
+  template <DepthFormat F>
+  void resolveSamples(const rect &clip);
+  // Stores c in the samples of mask, for the multisampling rasterizers without depth.
+  void coverSamples(int x, int y, unsigned mask, QRgb c);
+  template <DepthFormat F>
+  void updateHiZFar(int bx, int by);
+  template <DepthFormat F>
+  void raiseHiZNear(const rect &box, float depth);
+  template <DepthFormat F>
+  void depthWritten(const rect &box, float nearestZ);
+
   int w, h;
+  DepthFormat depthBufferFormat;
+  int colorPitch; // in pixels
+  int depthPitch; // in bytes
+  AlignedBuffer<QRgb> colorData;
+  AlignedBuffer<uchar> depthData;
+  int gbufferPitch; // in texels
+  AlignedBuffer<GBufferTexel> gbufferData;
+  int sampleCount = 1;
+  int sampleColorPitch = 0; // in pixels
+  int sampleDepthPitch = 0; // in bytes
+  int sampleMaskPitch = 0;  // in bytes
+  AlignedBuffer<QRgb> sampleColorData;
+  AlignedBuffer<uchar> sampleDepthData;
+  AlignedBuffer<uint8_t> sampleMaskData;
+
+  // Stored depth values of the buffer's format, as float. Every format converts exactly.
+  bool hizEnabled = true;
+  int hizBlocksX, hizBlocksY;
+  AlignedBuffer<float> hizFar;
+  AlignedBuffer<float> hizNear;
 };
@@ -0,0 +1,361 @@
+#include "IndexOrder.h"
+#include "Model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace
+{
+// Triangles using every vertex, in compressed rows: those of vertex v are
+// triangles[offsets[v]] to triangles[offsets[v+1]-1].
+struct VertexTriangles
+{
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> triangles;
+
+  VertexTriangles(IndexView indices, int vertexCount)
+    : offsets(vertexCount + 1), triangles(indices.size())
+  {
+    for (qsizetype i = 0; i < indices.size(); i++)
+      {
+        offsets[indices[i] + 1]++;
+      }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    for (qsizetype i = 0; i < indices.size(); i++)
+      {
+        triangles[next[indices[i]]++] = i/3;
+      }
+  }
+};
+
+// Overdraw is measured on a small grid: it only has to be fine enough to resolve most triangles.
+constexpr int OVERDRAW_RESOLUTION = 128;
+constexpr int OVERDRAW_VIEWS = 12;
+
+// Orthographic view of the mesh from direction, rasterized with a depth test. Returns the number
+// of pixels drawn and adds the number of pixels covered in the end to covered.
+qint64 drawnPixels(ArrayView<QVector3D> vertices, IndexView indices, QVector3D center,
+                   float radius, QVector3D direction, qint64 &covered)
+{
+  QVector3D helper = std::abs(direction.x()) < 0.9f ? QVector3D(1, 0, 0) : QVector3D(0, 1, 0);
+  QVector3D right = QVector3D::crossProduct(helper, direction).normalized();
+  QVector3D up = QVector3D::crossProduct(direction, right);
+
+  constexpr int N = OVERDRAW_RESOLUTION;
+  float scale = N/(2*radius);
+  std::vector<float> depth(N*N, -std::numeric_limits<float>::infinity());
+  auto project = [&](uint32_t v) {
+    QVector3D p = vertices[v] - center;
+    return QVector3D((QVector3D::dotProduct(p, right) + radius)*scale,
+                     (QVector3D::dotProduct(p, up) + radius)*scale,
+                     QVector3D::dotProduct(p, direction));
+  };
+
+  qint64 drawn = 0;
+  for (qsizetype t = 0; t < indices.size()/3; t++)
+    {
+      QVector3D a = project(indices[3*t]), b = project(indices[3*t+1]), c = project(indices[3*t+2]);
+      float area = (b.x() - a.x())*(c.y() - a.y()) - (b.y() - a.y())*(c.x() - a.x());
+      if (area <= 0)
+        {
+          continue; // back-facing or degenerate
+        }
+      int minx = std::max(0, (int)std::floor(std::min({a.x(), b.x(), c.x()})));
+      int maxx = std::min(N - 1, (int)std::ceil(std::max({a.x(), b.x(), c.x()})));
+      int miny = std::max(0, (int)std::floor(std::min({a.y(), b.y(), c.y()})));
+      int maxy = std::min(N - 1, (int)std::ceil(std::max({a.y(), b.y(), c.y()})));
+      for (int y = miny; y <= maxy; y++)
+        {
+          for (int x = minx; x <= maxx; x++)
+            {
+              float px = x + 0.5f, py = y + 0.5f;
+              float wa = (b.x() - px)*(c.y() - py) - (b.y() - py)*(c.x() - px);
+              float wb = (c.x() - px)*(a.y() - py) - (c.y() - py)*(a.x() - px);
+              float wc = area - wa - wb;
+              if (wa < 0 || wb < 0 || wc < 0)
+                {
+                  continue;
+                }
+              float z = (wa*a.z() + wb*b.z() + wc*c.z())/area;
+              float &stored = depth[y*N + x];
+              if (z > stored)
+                {
+                  stored = z;
+                  drawn++;
+                }
+            }
+        }
+    }
+  covered += std::count_if(depth.begin(), depth.end(), [](float d) { return std::isfinite(d); });
+  return drawn;
+}
+}
+
+double
+averageCacheMissRatio(IndexView indices, int vertexCount, int cacheSize)
+{
+  if (indices.isEmpty())
+    {
+      return 0;
+    }
+  // A vertex is in the cache when fewer than cacheSize others went in after it.
+  std::vector<qint64> cachedAt(vertexCount, -cacheSize);
+  qint64 misses = 0;
+  for (qsizetype i = 0; i < indices.size(); i++)
+    {
+      uint32_t v = indices[i];
+      if (misses - cachedAt[v] >= cacheSize)
+        {
+          cachedAt[v] = misses++;
+        }
+    }
+  return (double)misses/(indices.size()/3);
+}
+
+double
+averageOverdraw(ArrayView<QVector3D> vertices, IndexView indices)
+{
+  if (vertices.isEmpty() || indices.isEmpty())
+    {
+      return 0;
+    }
+  QVector3D lo = vertices[0], hi = vertices[0];
+  for (const QVector3D &v : vertices)
+    {
+      lo = QVector3D(std::min(lo.x(), v.x()), std::min(lo.y(), v.y()), std::min(lo.z(), v.z()));
+      hi = QVector3D(std::max(hi.x(), v.x()), std::max(hi.y(), v.y()), std::max(hi.z(), v.z()));
+    }
+  QVector3D center = (lo + hi)/2;
+  float radius = std::max((hi - lo).length()/2, 1e-6f);
+
+  // Directions spread evenly over the sphere, on a Fibonacci spiral.
+  qint64 drawn = 0, covered = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+: drawn, covered)
+  for (int i = 0; i < OVERDRAW_VIEWS; i++)
+    {
+      float z = 1 - (2*i + 1.0f)/OVERDRAW_VIEWS;
+      float r = std::sqrt(1 - z*z);
+      float phi = i*2.39996323f;
+      QVector3D direction(r*std::cos(phi), r*std::sin(phi), z);
+      drawn += drawnPixels(vertices, indices, center, radius, direction, covered);
+    }
+  return covered == 0 ? 0 : (double)drawn/covered;
+}
+
+std::vector<uint32_t>
+tipsify(IndexView indices, int vertexCount, int cacheSize, std::vector<uint32_t> &clusterStarts)
+{
+  qsizetype triangleCount = indices.size()/3;
+  VertexTriangles adjacency(indices, vertexCount);
+  std::vector<int> liveTriangles(vertexCount);
+  for (int v = 0; v < vertexCount; v++)
+    {
+      liveTriangles[v] = adjacency.offsets[v+1] - adjacency.offsets[v];
+    }
+  std::vector<qint64> cachedAt(vertexCount, 0);
+  std::vector<bool> emitted(triangleCount);
+  std::vector<uint32_t> deadEnds;
+  std::vector<uint32_t> candidates;
+
+  std::vector<uint32_t> order;
+  order.reserve(triangleCount);
+  clusterStarts.clear();
+  qint64 time = cacheSize + 1;
+  int cursor = 0;     // vertices before it have no live triangles left
+  int fanning = 0;
+  bool jumped = true; // the fanning vertex isn't adjacent to the previous triangles
+  while (fanning >= 0)
+    {
+      if (jumped)
+        {
+          clusterStarts.push_back(order.size());
+        }
+      candidates.clear();
+      for (uint32_t k = adjacency.offsets[fanning]; k < adjacency.offsets[fanning+1]; k++)
+        {
+          uint32_t t = adjacency.triangles[k];
+          if (emitted[t])
+            {
+              continue;
+            }
+          for (int i = 0; i < 3; i++)
+            {
+              uint32_t v = indices[3*t + i];
+              deadEnds.push_back(v);
+              candidates.push_back(v);
+              liveTriangles[v]--;
+              if (time - cachedAt[v] > cacheSize)
+                {
+                  cachedAt[v] = time++;
+                }
+            }
+          emitted[t] = true;
+          order.push_back(t);
+        }
+
+      // The next vertex to fan around is the candidate that will still be in the cache after
+      // its remaining triangles are emitted and has been there longest. When there is none, go
+      // back to a vertex used recently, or else to the first one with triangles left.
+      fanning = -1;
+      qint64 best = -1;
+      for (uint32_t v : candidates)
+        {
+          if (liveTriangles[v] > 0)
+            {
+              qint64 priority = 0;
+              if (time - cachedAt[v] + 2*liveTriangles[v] <= cacheSize)
+                {
+                  priority = time - cachedAt[v];
+                }
+              if (priority > best)
+                {
+                  best = priority;
+                  fanning = v;
+                }
+            }
+        }
+      jumped = fanning < 0;
+      while (fanning < 0 && !deadEnds.empty())
+        {
+          uint32_t v = deadEnds.back();
+          deadEnds.pop_back();
+          if (liveTriangles[v] > 0)
+            {
+              fanning = v;
+            }
+        }
+      for (; fanning < 0 && cursor < vertexCount; cursor++)
+        {
+          if (liveTriangles[cursor] > 0)
+            {
+              fanning = cursor;
+            }
+        }
+    }
+  // The first vertex may have had no triangles.
+  if (!clusterStarts.empty() && clusterStarts.back() == order.size())
+    {
+      clusterStarts.pop_back();
+    }
+  clusterStarts.erase(std::unique(clusterStarts.begin(), clusterStarts.end()), clusterStarts.end());
+  return order;
+}
+
+std::vector<uint32_t>
+sortClustersForOverdraw(ArrayView<QVector3D> vertices, IndexView indices,
+                        const std::vector<uint32_t> &order, const std::vector<uint32_t> &clusterStarts)
+{
+  struct Cluster
+  {
+    uint32_t begin, end;
+    float key;
+  };
+
+  // Area weighted centroid and normal of every cluster, and of the whole mesh.
+  std::vector<Cluster> clusters;
+  std::vector<QVector3D> centroids, normals;
+  QVector3D meshCentroid;
+  float meshArea = 0;
+  for (size_t c = 0; c < clusterStarts.size(); c++)
+    {
+      uint32_t begin = clusterStarts[c];
+      uint32_t end = c + 1 < clusterStarts.size() ? clusterStarts[c+1] : order.size();
+      QVector3D centroid, normal;
+      float area = 0;
+      for (uint32_t k = begin; k < end; k++)
+        {
+          uint32_t t = order[k];
+          const QVector3D &a = vertices[indices[3*t]];
+          const QVector3D &b = vertices[indices[3*t+1]];
+          const QVector3D &c = vertices[indices[3*t+2]];
+          QVector3D n = QVector3D::crossProduct(b - a, c - a); // length is twice the area
+          centroid += n.length()*(a + b + c)/3;
+          normal += n;
+          area += n.length();
+        }
+      meshCentroid += centroid;
+      meshArea += area;
+      clusters.push_back({begin, end, 0});
+      centroids.push_back(area > 0 ? centroid/area : centroid);
+      normals.push_back(normal);
+    }
+  if (meshArea > 0)
+    {
+      meshCentroid /= meshArea;
+    }
+
+  // Clusters far out along their normal are in front of the rest of the mesh from most of the
+  // directions they can be seen from.
+  for (size_t c = 0; c < clusters.size(); c++)
+    {
+      clusters[c].key = QVector3D::dotProduct(centroids[c] - meshCentroid, normals[c].normalized());
+    }
+  std::stable_sort(clusters.begin(), clusters.end(),
+                   [](const Cluster &a, const Cluster &b) { return a.key > b.key; });
+
+  std::vector<uint32_t> sorted;
+  sorted.reserve(order.size());
+  for (const Cluster &cluster : clusters)
+    {
+      sorted.insert(sorted.end(), order.begin() + cluster.begin, order.begin() + cluster.end);
+    }
+  return sorted;
+}
+
+std::vector<uint32_t>
+optimizedTriangleOrder(ArrayView<QVector3D> vertices, IndexView indices)
+{
+  std::vector<uint32_t> clusterStarts;
+  std::vector<uint32_t> order = tipsify(indices, vertices.size(), VERTEX_CACHE_SIZE, clusterStarts);
+  return sortClustersForOverdraw(vertices, indices, order, clusterStarts);
+}
+
+// Owned copies of the arrays are made first when the Model is mapped from a mesh cache.
+IndexOrderStats
+Model::optimizeIndexOrder()
+{
+  detach();
+  int vertexCount = vertexData.size();
+  IndexOrderStats stats;
+  stats.acmrBefore = averageCacheMissRatio(indices(), vertexCount);
+  stats.overdrawBefore = averageOverdraw(vertices(), indices());
+
+  std::vector<uint32_t> order = optimizedTriangleOrder(vertices(), indices());
+
+  // The vertices are renumbered in the order the triangles first use them, so that they are
+  // fetched front to back. Unused vertices go last.
+  constexpr uint32_t UNUSED = ~0u;
+  std::vector<uint32_t> remap(vertexCount, UNUSED);
+  QVector<uint32_t> reordered;
+  reordered.reserve(3*order.size());
+  uint32_t next = 0;
+  IndexView old = indices();
+  for (uint32_t t : order)
+    {
+      for (int i = 0; i < 3; i++)
+        {
+          uint32_t &v = remap[old[3*t + i]];
+          if (v == UNUSED)
+            {
+              v = next++;
+            }
+          reordered.append(v);
+        }
+    }
+  for (uint32_t &v : remap)
+    {
+      if (v == UNUSED)
+        {
+          v = next++;
+        }
+    }
+  renumberVertices(remap);
+  setLods({std::move(reordered)}, {0.0f});
+
+  stats.acmrAfter = averageCacheMissRatio(indices(), vertexCount);
+  stats.overdrawAfter = averageOverdraw(vertices(), indices());
+  return stats;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ArrayView.h"
+
+#include <QVector3D>
+#include <cstdint>
+#include <vector>
+
+// Load-time triangle reordering, after Sander, Nehab and Barczak, "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw" (2007).
+//
+// Tipsify orders the triangles so that consecutive ones share vertices, and cuts the order into
+// clusters where it has to jump. The clusters are then sorted so that those facing outwards,
+// which are the likeliest to hide others from any direction, are drawn first.
+
+// Entries of the FIFO vertex cache that Tipsify optimizes for and averageCacheMissRatio()
+// simulates.
+constexpr int VERTEX_CACHE_SIZE = 16;
+
+// Vertices that miss a FIFO cache of cacheSize entries, per triangle: 3 when no vertex is ever
+// reused, and around 0.5 for a regular grid in a good order.
+double averageCacheMissRatio(IndexView indices, int vertexCount, int cacheSize = VERTEX_CACHE_SIZE);
+
+// Pixels that pass the depth test per visible pixel, averaged over views from several directions.
+// Back faces are culled. 1 means that no pixel is ever drawn twice.
+double averageOverdraw(ArrayView<QVector3D> vertices, IndexView indices);
+
+// Returns the triangles, as indices into indices()/3, in vertex cache order. clusterStarts gets
+// the position in that order of the first triangle of every cluster.
+std::vector<uint32_t> tipsify(IndexView indices, int vertexCount, int cacheSize,
+                              std::vector<uint32_t> &clusterStarts);
+
+// Reorders the clusters of a Tipsify order from the outside of the mesh to its inside.
+std::vector<uint32_t> sortClustersForOverdraw(ArrayView<QVector3D> vertices, IndexView indices,
+                                              const std::vector<uint32_t> &order,
+                                              const std::vector<uint32_t> &clusterStarts);
+
+// tipsify() followed by sortClustersForOverdraw().
+std::vector<uint32_t> optimizedTriangleOrder(ArrayView<QVector3D> vertices, IndexView indices);
+
+struct IndexOrderStats
+{
+  double acmrBefore, acmrAfter;
+  double overdrawBefore, overdrawAfter;
+};
@@ -1,212 +1,106 @@
 #include "MainWindow.h"
 #include "./ui_MainWindow.h"
 
+#include <QElapsedTimer>
 #include <QKeyEvent>
-#include <QMatrix4x4>
 #include <QPainter>
 #include <algorithm>
 
-constexpr QRgb white   = qRgba(255, 255, 255, 255);
-constexpr QRgb green   = qRgba(  0, 255, 0, 255);
-constexpr QRgb red     = qRgba(255,   0,   0, 255);
-constexpr QRgb blue    = qRgba( 64, 128, 255, 255);
-constexpr QRgb purple  = qRgba(128, 128, 255, 255);
-constexpr QRgb orange  = qRgba(0xff, 0x5c, 0, 255);
-constexpr QRgb magenta = qRgba(255,   0, 255, 255);
-constexpr QRgb cyan    = qRgba(  0, 255, 255, 255);
-constexpr QRgb yellow  = qRgba(255, 200,   0, 255);
+namespace
+{
+std::optional<Model>
+loadModel()
+{
+  QStringList args = QCoreApplication::arguments();
+  if (args.size() > 1)
+    {
+      const QString filename = args.at(1);
+      qDebug() << QString("Reading OBJ file %1 from the argument list").arg(filename);
+      return Model::load(filename, IndexOrder::Optimized);
+    }
+  return std::nullopt;
+}
+}
 
 MainWindow::MainWindow (int width, int height, QWidget *parent)
-    : QMainWindow (parent), ui (new Ui::MainWindow), /*fb(64, 64)*/  fb(width, height),
-      w(width), h(height)
+    : QMainWindow (parent), w(width), h(height), ui (new Ui::MainWindow),
+      renderThread(width, height, loadModel())
 {
   setFixedSize(2*width, height);
   //setWindowFlags(Qt::FramelessWindowHint);
   ui->setupUi (this);
   setStatusBar(nullptr);
 
-  QStringList args = QCoreApplication::arguments();
-  if (args.size() > 1)
-    {
-      const QString filename = args.at(1);
-      qDebug() << QString("Reading OBJ file %1 from the argument list").arg(filename);
-      model = Model::readObjFile(filename);
-    }
+  // frameReady() comes from the render thread, so update() is queued to the GUI thread.
+  connect(&renderThread, &RenderThread::frameReady, this, [this] { update(); });
+  renderThread.post(state);
+  renderThread.start();
 }
 
-MainWindow::~MainWindow () { delete ui; }
+MainWindow::~MainWindow ()
+{
+  renderThread.stop();
+  renderThread.wait();
+  delete ui;
+}
 
 void
 MainWindow::paintEvent (QPaintEvent *event)
 {
-  fb.clear(QColor(0,0,0,0));
-  fb.clearDepthBuffer();
-
   QElapsedTimer timer;
   timer.start();
-  if (model.has_value())
-    {
-      drawModel();
-    }
-  else
-    {
-      drawShapes();
-    }
-  qint64 elapsedMs = timer.elapsed();
-  qDebug() << "Frame drawn in " << elapsedMs << "ms";
+  const RenderedFrame &frame = renderThread.latestFrame();
 
   QPainter painter(this);
   painter.setRenderHint(QPainter::Antialiasing, false);
   painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
   painter.fillRect(rect(), Qt::black);
-  painter.drawImage(QRectF(0,0,w,h), fb.qimage());
-  painter.drawImage(QRectF(w,0,w,h), fb.depthMap());
-
+  painter.drawImage(QRectF(0,0,w,h), frame.fb.qimage());
+  painter.drawImage(QRectF(w,0,w,h), frame.depthMap);
+  presentNs = timer.nsecsElapsed();
 
+#ifdef TINYRENDERER_PROFILING
+  if (showProfile)
+    {
+      drawProfile(painter, frame.profile);
+    }
+#endif
 }
 
 void
-MainWindow::drawShapes ()
+MainWindow::drawProfile (QPainter &painter, const Profiler::FrameProfile &profile)
 {
-  int ax =  7, ay =  3;
-  int bx = 12, by = 37;
-  int cx = 62, cy = 53;
-
-  if (drawTriangle)
-    {
-      fb.triangle({ax, ay}, {bx, by}, {cx, cy}, blue);
-    }
-  else if (drawTriangle2)
-    {
-      fb.triangle2({ax, ay}, {bx, by}, {cx, cy}, orange);
-    }
-  else if (drawTriangle3)
-    {
-      fb.triangle3({ax, ay}, {cx, cy}, {bx, by}, magenta);
-    }
-  else if (drawTriangle4)
+  // Stage times and counters of the frame shown, in the top left corner. The render thread's
+  // frames don't include presenting, which happens here on the GUI thread while the next frame
+  // is drawn, so that is the time the last paint took.
+  QStringList lines;
+  for (int i = 0; i < int(Profiler::Stage::Count); i++)
     {
-      fb.triangle4({ax, ay}, {50, 20}, {cx, cy}, magenta);
-      fb.triangle4({ax, ay}, {cx, cy}, {bx, by}, cyan);
+      Profiler::Stage stage = Profiler::Stage(i);
+      qint64 ns = stage == Profiler::Stage::Present ? presentNs : profile.stageNs[i];
+      lines << QString("%1: %2 ms").arg(Profiler::stageName(stage)).arg(ns/1e6, 0, 'f', 2);
     }
-  else if (drawTriangle5)
+  lines << QString("Total: %1 ms").arg((profile.totalNs() + presentNs)/1e6, 0, 'f', 2);
+  for (int i = 0; i < int(Profiler::Counter::Count); i++)
     {
-      fb.triangle5({ax, ay}, {50, 20}, {cx, cy}, magenta);
-      fb.triangle5({ax, ay}, {cx, cy}, {bx, by}, cyan);
-    }
-  else if (drawTriangle6)
-    {
-      fb.triangle6({ax, ay}, {50, 20}, {cx, cy}, magenta);
-      fb.triangle6({ax, ay}, {cx, cy}, {bx, by}, cyan);
-    }
-
-  if (drawLines)
-    {
-      fb.line(ax, ay, bx, by, purple);
-      fb.line(cx, cy, bx, by, green);
-      fb.line(cx, cy, ax, ay, yellow);
-      fb.line(ax, ay, cx, cy, red);
+      lines << QString("%1: %2").arg(Profiler::counterName(Profiler::Counter(i)))
+                                .arg(profile.counters[i]);
     }
+  lines << QString("Overdraw: %1").arg(profile.overdraw(), 0, 'f', 2);
 
-  if (drawPoints)
+  QFontMetrics metrics = painter.fontMetrics();
+  int lineHeight = metrics.height();
+  int width = 0;
+  for (const QString &line : lines)
     {
-      fb.set(ax, ay, white);
-      fb.set(bx, by, white);
-      fb.set(cx, cy, white);
+      width = std::max(width, metrics.horizontalAdvance(line));
     }
-}
-
-inline void
-MainWindow::drawWireframeTriangle (const QVector3D &v0, const QVector3D &v1,
-                                   const QVector3D &v2, QColor c)
-{
-  // To draw a triangle in wireframe mode, draw its three edges.
-  // The model is supposed to fit in the [-1,1]^3 cube, so we translate it to [0,2]^3
-  // and then scale it to (0, width/2) in the X axis and (0, height/2) in the Y axis.
-
-  float halfWidth = fb.width()/2.0f;
-  float halfHeight = fb.height()/2.0f;
-
-  int x0 = (v0.x() + 1)*halfWidth;
-  int x1 = (v1.x() + 1)*halfWidth;
-  int x2 = (v2.x() + 1)*halfWidth;
-  int y0 = (v0.y() + 1)*halfHeight;
-  int y1 = (v1.y() + 1)*halfHeight;
-  int y2 = (v2.y() + 1)*halfHeight;
-
-  fb.line(x0, y0, x1, y1, c);
-  fb.line(x1, y1, x2, y2, c);
-  fb.line(x2, y2, x1, y1, c);
-}
-
-inline point
-MainWindow::project(const QVector3D &v)
-{
-  int x = std::clamp((int)std::round((v.x()+1)*fb.width()/2.0), 0, fb.width()-1);
-  int y = std::clamp((int)std::round((v.y()+1)*fb.height()/2.0), 0, fb.height()-1);
-  return {x, y};
-}
-
-inline point3
-MainWindow::project3(const QVector3D &v)
-{
-  int x = std::clamp((int)std::round((v.x()+1)*fb.width()/2.0), 0, fb.width()-1);
-  int y = std::clamp((int)std::round((v.y()+1)*fb.height()/2.0), 0, fb.height()-1);
-  int z = (v.z() + 1.0)*255.0/2;
-  return {x, y, z};
-}
-
-void
-MainWindow::drawModel ()
-{
-  const QVector<QVector3D> &vertices = model->vertices();
-  const QVector<uint16_t> &indices = model->indices();
-
-
-  void (FrameBuffer::*triangleFunc)(point p, point q, point r, QColor c) = nullptr;
-  if      (drawTriangle)  triangleFunc = &FrameBuffer::triangle;
-  else if (drawTriangle2) triangleFunc = &FrameBuffer::triangle2;
-  else if (drawTriangle3) triangleFunc = &FrameBuffer::triangle3;
-  else if (drawTriangle4) triangleFunc = &FrameBuffer::triangle4;
-  else if (drawTriangle5) triangleFunc = &FrameBuffer::triangle5;
-  else if (drawTriangle6) triangleFunc = &FrameBuffer::triangle6;
-
-
-  std::srand(0x1u);
-  QQuaternion q = QQuaternion::fromAxisAndAngle(QVector3D(0,1,0), yRot);
-
-  // A Model read by Model::readObjFile() is guaranteed to have a number indices that is a multiple
-  // of 3.
-  for (int i = 0; i < indices.size()/3; i++)
+  painter.fillRect(QRect(4, 4, width + 8, lines.size()*lineHeight + 8), QColor(0, 0, 0, 160));
+  painter.setPen(Qt::white);
+  for (int i = 0; i < lines.size(); i++)
     {
-      const QVector3D &v0 = q.rotatedVector(vertices[indices[3*i+0]]);
-      const QVector3D &v1 = q.rotatedVector(vertices[indices[3*i+1]]);
-      const QVector3D &v2 = q.rotatedVector(vertices[indices[3*i+2]]);
-
-      //drawWireframeTriangle(v0, v1, v2, c);
-      QColor c(std::rand()%255, std::rand()%255, std::rand()%255, 255);
-      if (triangleFunc != nullptr)
-        {
-          if (depthTesting)
-            {
-              fb.triangle3z(project3(v0), project3(v1), project3(v2), c);
-            }
-          else
-            {
-              (fb.*triangleFunc)(project(v0), project(v1), project(v2), c);
-            }
-        }
+      painter.drawText(8, 8 + i*lineHeight + metrics.ascent(), lines[i]);
     }
-
-  // int w = fb.width();
-  // int h = fb.height();
-  // for (int i = 0; i < vertices.size(); i++)
-  //   {
-  //     const QVector3D &v = vertices[i];
-  //     int x = std::clamp((int)std::round((v.x()+1)*w/2.0), 0, w-1);
-  //     int y = std::clamp((int)std::round((v.y()+1)*h/2.0), 0, h-1);
-  //     fb.set(x, y, white);
-  //   }
 }
 
 void
@@ -215,51 +109,61 @@ MainWindow::keyPressEvent (QKeyEvent *e)
   bool stateChange = false;
 
   int key = e->key();
-  if (Qt::Key_1 <= key && key <= Qt::Key_8)
+  if (Qt::Key_0 <= key && key <= Qt::Key_9)
     {
       stateChange = true;
     }
-  if (Qt::Key_1 <= key && key <= Qt::Key_6)
+  if ((Qt::Key_1 <= key && key <= Qt::Key_6) || key == Qt::Key_9 || key == Qt::Key_0)
     {
-      drawTriangle = false;
-      drawTriangle2 = false;
-      drawTriangle3 = false;
-      drawTriangle4 = false;
-      drawTriangle5 = false;
-      drawTriangle6 = false;
+      state.drawTriangle = false;
+      state.drawTriangle2 = false;
+      state.drawTriangle3 = false;
+      state.drawTriangle4 = false;
+      state.drawTriangle5 = false;
+      state.drawTriangle6 = false;
+      state.drawTriangle5Simd = false;
+      state.drawTriangleFixed = false;
     }
 
   if (e->key() == Qt::Key_1)
     {
-      drawTriangle2 = true; // drawTriangle is under maintenance :p
+      state.drawTriangle2 = true; // drawTriangle is under maintenance :p
     }
   else if (e->key() == Qt::Key_2)
     {
-      drawTriangle2 = true;
+      state.drawTriangle2 = true;
     }
   else if (e->key() == Qt::Key_3)
     {
-      drawTriangle3 = true;
+      state.drawTriangle3 = true;
     }
   else if (e->key() == Qt::Key_4)
     {
-      drawTriangle4 = true;
+      state.drawTriangle4 = true;
     }
   else if (e->key() == Qt::Key_5)
     {
-      drawTriangle5 = true;
+      state.drawTriangle5 = true;
     }
   else if (e->key() == Qt::Key_6)
     {
-      drawTriangle6 = true;
+      state.drawTriangle6 = true;
     }
   else if (e->key() == Qt::Key_7)
     {
-      drawLines = !drawLines;
+      state.drawLines = !state.drawLines;
     }
   else if (e->key() == Qt::Key_8)
     {
-      drawPoints = !drawPoints;
+      state.drawPoints = !state.drawPoints;
+    }
+  else if (e->key() == Qt::Key_9)
+    {
+      state.drawTriangle5Simd = true;
+    }
+  else if (e->key() == Qt::Key_0)
+    {
+      state.drawTriangleFixed = true;
     }
   else if (e->key() == Qt::Key_Escape)
     {
@@ -267,25 +171,95 @@ MainWindow::keyPressEvent (QKeyEvent *e)
     }
   else if (e->key() == Qt::Key_Z)
     {
-      depthTesting = !depthTesting;
+      state.depthTesting = !state.depthTesting;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_H)
+    {
+      state.hiZ = !state.hiZ;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_M)
+    {
+      // 1, 4 and 8 samples per pixel.
+      state.samples = state.samples == 1 ? 4 : state.samples == 4 ? 8 : 1;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_B)
+    {
+      state.backFaceCulling = !state.backFaceCulling;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_C)
+    {
+      // Flat, vertex colors, Gouraud, Phong.
+      state.shading = Shading((int(state.shading) + 1) % (int(Shading::Phong) + 1));
       stateChange = true;
     }
+  else if (e->key() == Qt::Key_G)
+    {
+      state.deferred = !state.deferred;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_D)
+    {
+      state.depthPrepass = !state.depthPrepass;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_S)
+    {
+      state.shadows = !state.shadows;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_F)
+    {
+      state.shadowPcf = !state.shadowPcf;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_L)
+    {
+      state.lodSelection = !state.lodSelection;
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_Minus)
+    {
+      state.zoom = std::max(state.zoom/2, 1.0f/64);
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_Plus || e->key() == Qt::Key_Equal)
+    {
+      state.zoom = std::min(state.zoom*2, 1.0f);
+      stateChange = true;
+    }
+  else if (e->key() == Qt::Key_P)
+    {
+      showProfile = !showProfile;
+      update(); // nothing to redraw, the overlay is painted over the frame
+    }
+  else if (e->key() == Qt::Key_T)
+    {
+      // The frames so far, for chrome://tracing or Perfetto.
+      bool written = Profiler::writeChromeTrace("trace.json");
+      qDebug() << (written ? "Wrote trace.json" : "Could not write trace.json");
+    }
 
   if (key == Qt::Key_Right)
     {
-      yRot += 36;
-      yRot %= 360;
+      state.yRot += 36;
+      state.yRot %= 360;
       stateChange = true;
     }
   else if (key == Qt::Key_Left)
     {
-      yRot -= 36;
-      yRot %= 360;
+      state.yRot -= 36;
+      state.yRot %= 360;
       stateChange = true;
     }
 
+  // The render thread picks the new state up when it is done with the current frame, and the
+  // window repaints when that frame is ready.
   if (stateChange)
     {
-      update();
+      renderThread.post(state);
     }
 }
@@ -1,9 +1,10 @@
 #pragma once
 
-#include "FrameBuffer.h"
-#include "Model.h"
+#include "Profiler.h"
+#include "RenderThread.h"
 
 #include <QMainWindow>
+#include <QPainter>
 #include <qlabel.h>
 
 QT_BEGIN_NAMESPACE
@@ -24,29 +25,16 @@ public:
 protected:
   void paintEvent(QPaintEvent *event) override;
   void keyPressEvent(QKeyEvent *e) override;
-  void drawShapes();
-  void drawModel();
-  void drawWireframeTriangle (const QVector3D &v0, const QVector3D &v1,
-                              const QVector3D &v2, QColor c);
-  point project(const QVector3D &v);
-  point3 project3(const QVector3D &v);
+  void drawProfile(QPainter &painter, const Profiler::FrameProfile &profile);
 
 private:
   int w, h;
   Ui::MainWindow *ui;
-  FrameBuffer fb;
+  // Frames are drawn on the render thread; paintEvent() only shows the latest one.
+  RenderThread renderThread;
   QLabel bg;
-  std::optional<Model> model;
-  int yRot = 0;
-
-  bool drawTriangle = false;
-  bool drawTriangle2 = true;
-  bool drawTriangle3 = false;
-  bool drawTriangle4 = false;
-  bool drawTriangle5 = false;
-  bool drawTriangle6 = false;
-  bool drawLines = false;
-  bool drawPoints = false;
-
-  bool depthTesting{false};
+  RenderState state;
+  bool showProfile = true;
+  // Time the last paintEvent() took to show its frame, on the GUI thread.
+  qint64 presentNs = 0;
 };
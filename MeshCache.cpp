@@ -0,0 +1,330 @@
+// The mesh cache: a binary copy of a parsed Model, written next to the OBJ file it was read from.
+//
+// The arrays are stored exactly as they are laid out in memory, each at a 64-byte aligned offset,
+// so a cached Model is just a memory map of the file and views into it. Nothing is parsed or
+// copied. The indices and meshlets are read once when the cache is opened, to check that they stay
+// in range; the vertex data only when the renderer touches it.
+//
+// The header records the size, modification time and a sampled hash of the OBJ file. When any of
+// them no longer matches, the cache is stale and the OBJ file is parsed again.
+
+#include "AlignedBuffer.h"
+#include "Model.h"
+
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtCore/qdebug.h>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+constexpr char MAGIC[8] = {'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H'};
+// Bumped whenever the layout below or the way Models are read from OBJ files changes.
+constexpr quint32 VERSION = 6;
+
+enum Section
+{
+  Vertices,
+  Indices,
+  Normals,
+  Texcoords,
+  Meshlets,
+  MeshletVertices,
+  MeshletTriangles,
+  Lods,
+  SectionCount,
+};
+
+// All fields are little-endian.
+struct Header
+{
+  char magic[8];
+  quint32 version;
+  quint32 headerSize;
+  quint32 indexSize;     // bytes per index, 2 or 4
+  quint32 indexOrder;    // IndexOrder
+  float boundingRadius;
+  quint32 reserved;
+  quint64 sourceSize;
+  qint64 sourceModified; // ms since the epoch
+  quint64 sourceHash;
+  quint64 counts[SectionCount];
+  quint64 offsets[SectionCount];
+};
+
+qint64 elementSize(const Header &header, int section)
+{
+  switch (section)
+    {
+    case Vertices:         return sizeof(QVector3D);
+    case Indices:          return header.indexSize;
+    case Normals:          return sizeof(QVector3D);
+    case Texcoords:        return sizeof(QVector2D);
+    case Meshlets:         return sizeof(Meshlet);
+    case MeshletVertices:  return sizeof(uint32_t);
+    case MeshletTriangles: return 3*sizeof(uint8_t);
+    case Lods:             return sizeof(ModelLod);
+    }
+  return 0;
+}
+
+// Whether every value is below limit. Without an early exit, so that it vectorizes.
+template <typename T>
+bool allBelow(const T *values, quint64 count, quint64 limit)
+{
+  T largest = 0;
+  for (quint64 i = 0; i < count; i++)
+    {
+      largest = std::max(largest, values[i]);
+    }
+  return count == 0 || largest < limit;
+}
+
+qint64 alignedOffset(qint64 offset)
+{
+  return (offset + CACHE_LINE_SIZE-1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+}
+
+// FNV-1a over the size and a fixed number of blocks of the file: the first, the last and evenly
+// spaced ones in between. Hashing all of it would cost as much as parsing it on a cold cache,
+// while this takes the same time for any size and still catches files rewritten with the same
+// size and modification time.
+bool hashFile(QFile &file, quint64 &hash)
+{
+  constexpr qint64 BLOCK_SIZE = 64*1024;
+  constexpr int BLOCKS = 16;
+
+  qint64 size = file.size();
+  hash = 14695981039346656037ull;
+  auto add = [&hash](const uchar *p, qint64 n) {
+    for (qint64 i = 0; i < n; i++)
+      {
+        hash = (hash ^ p[i])*1099511628211ull;
+      }
+  };
+  quint64 littleSize = qToLittleEndian<quint64>(size);
+  add(reinterpret_cast<const uchar*>(&littleSize), sizeof(littleSize));
+  if (size == 0)
+    {
+      return true;
+    }
+  const uchar *data = file.map(0, size);
+  if (data == nullptr)
+    {
+      return false;
+    }
+  if (size <= BLOCKS*BLOCK_SIZE)
+    {
+      add(data, size);
+    }
+  else
+    {
+      for (int i = 0; i < BLOCKS; i++)
+        {
+          add(data + (size - BLOCK_SIZE)*i/(BLOCKS-1), BLOCK_SIZE);
+        }
+    }
+  file.unmap(const_cast<uchar*>(data));
+  return true;
+}
+
+bool describeSource(const QString &filename, Header &header)
+{
+  QFile file(filename);
+  if (!file.open(QIODeviceBase::ReadOnly))
+    {
+      return false;
+    }
+  header.sourceSize = file.size();
+  header.sourceModified = QFileInfo(file).lastModified().toMSecsSinceEpoch();
+  return hashFile(file, header.sourceHash);
+}
+}
+
+QString
+Model::meshCachePath(const QString &objFilename)
+{
+  return objFilename + ".meshcache";
+}
+
+std::optional<Model>
+Model::readMeshCache(const QString &objFilename, IndexOrder order)
+{
+  // The sections are mapped as they are, so the cache is only usable in the byte order it was
+  // written in.
+  if (Q_BYTE_ORDER != Q_LITTLE_ENDIAN)
+    {
+      return {};
+    }
+
+  auto file = std::make_shared<QFile>(meshCachePath(objFilename));
+  if (!file->open(QIODeviceBase::ReadOnly) || file->size() < (qint64)sizeof(Header))
+    {
+      return {};
+    }
+  qint64 size = file->size();
+  const uchar *data = file->map(0, size);
+  if (data == nullptr)
+    {
+      return {};
+    }
+
+  Header header;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+      || header.headerSize != sizeof(Header) || (header.indexSize != 2 && header.indexSize != 4)
+      || header.indexOrder != (quint32)order)
+    {
+      return {};
+    }
+  Header source;
+  if (!describeSource(objFilename, source) || source.sourceSize != header.sourceSize
+      || source.sourceModified != header.sourceModified || source.sourceHash != header.sourceHash)
+    {
+      return {};
+    }
+  for (int s = 0; s < SectionCount; s++)
+    {
+      quint64 offset = header.offsets[s];
+      if (offset % CACHE_LINE_SIZE != 0 || offset < sizeof(Header) || offset > (quint64)size
+          || header.counts[s] > ((quint64)size - offset)/elementSize(header, s))
+        {
+          qWarning() << QString("Ignoring the corrupt mesh cache %1.").arg(file->fileName());
+          return {};
+        }
+    }
+  quint64 vertexCount = header.counts[Vertices];
+  const ModelLod *lods = reinterpret_cast<const ModelLod*>(data + header.offsets[Lods]);
+  bool lodsValid = true;
+  for (quint64 i = 0; i < header.counts[Lods]; i++)
+    {
+      lodsValid = lodsValid && (quint64)lods[i].firstIndex + lods[i].indexCount <= header.counts[Indices]
+                  && (quint64)lods[i].firstMeshlet + lods[i].meshletCount <= header.counts[Meshlets]
+                  && lods[i].vertexCount <= vertexCount;
+    }
+  if (header.counts[Indices] % 3 != 0 || (header.indexSize == 2 && vertexCount > 65536)
+      || (header.counts[Normals] != 0 && header.counts[Normals] != vertexCount)
+      || (header.counts[Texcoords] != 0 && header.counts[Texcoords] != vertexCount) || !lodsValid)
+    {
+      qWarning() << QString("Ignoring the corrupt mesh cache %1.").arg(file->fileName());
+      return {};
+    }
+  // The contents are used without bounds checks, and a cache that matches its source can still
+  // hold garbage, from a partial write or another program. So every index into another array is
+  // checked too, which reads the sections once.
+  const uchar *indices = data + header.offsets[Indices];
+  bool indicesValid = header.indexSize == 2
+      ? allBelow(reinterpret_cast<const uint16_t*>(indices), header.counts[Indices], vertexCount)
+      : allBelow(reinterpret_cast<const uint32_t*>(indices), header.counts[Indices], vertexCount);
+  const Meshlet *meshlets = reinterpret_cast<const Meshlet*>(data + header.offsets[Meshlets]);
+  const uint32_t *meshletVertices = reinterpret_cast<const uint32_t*>(data + header.offsets[MeshletVertices]);
+  const uchar *meshletTriangles = data + header.offsets[MeshletTriangles];
+  bool meshletsValid = true;
+  for (quint64 i = 0; i < header.counts[Meshlets]; i++)
+    {
+      const Meshlet &m = meshlets[i];
+      meshletsValid = meshletsValid && (quint64)m.vertexOffset + m.vertexCount <= header.counts[MeshletVertices]
+                      && (quint64)m.triangleOffset + m.triangleCount <= header.counts[MeshletTriangles]
+                      && allBelow(meshletTriangles + 3*(quint64)m.triangleOffset, 3*m.triangleCount,
+                                  m.vertexCount);
+    }
+  // A LOD only has its first vertexCount vertices.
+  for (quint64 i = 0; i < header.counts[Lods] && meshletsValid; i++)
+    {
+      for (quint64 j = lods[i].firstMeshlet; j < (quint64)lods[i].firstMeshlet + lods[i].meshletCount; j++)
+        {
+          meshletsValid = meshletsValid && allBelow(meshletVertices + meshlets[j].vertexOffset,
+                                                    meshlets[j].vertexCount, lods[i].vertexCount);
+        }
+    }
+  if (!indicesValid || !meshletsValid)
+    {
+      qWarning() << QString("Ignoring the corrupt mesh cache %1.").arg(file->fileName());
+      return {};
+    }
+
+  Model model;
+  model.cachedVertices = {reinterpret_cast<const QVector3D*>(data + header.offsets[Vertices]),
+                          (qsizetype)header.counts[Vertices]};
+  if (header.indexSize == 2)
+    {
+      model.cachedIndices = ArrayView<uint16_t>(reinterpret_cast<const uint16_t*>(indices),
+                                                (qsizetype)header.counts[Indices]);
+    }
+  else
+    {
+      model.cachedIndices = ArrayView<uint32_t>(reinterpret_cast<const uint32_t*>(indices),
+                                                (qsizetype)header.counts[Indices]);
+    }
+  model.cachedNormals = {reinterpret_cast<const QVector3D*>(data + header.offsets[Normals]),
+                         (qsizetype)header.counts[Normals]};
+  model.cachedTexcoords = {reinterpret_cast<const QVector2D*>(data + header.offsets[Texcoords]),
+                           (qsizetype)header.counts[Texcoords]};
+  model.cachedMeshlets = {meshlets, (qsizetype)header.counts[Meshlets]};
+  model.cachedMeshletVertices = {meshletVertices, (qsizetype)header.counts[MeshletVertices]};
+  model.cachedMeshletTriangles = {meshletTriangles, 3*(qsizetype)header.counts[MeshletTriangles]};
+  model.cachedLods = {lods, (qsizetype)header.counts[Lods]};
+  model.boundsRadius = header.boundingRadius;
+  model.cacheFile = std::move(file);
+  return model;
+}
+
+// Written through QSaveFile, so a crash or a concurrent reader never sees a partial cache.
+bool
+Model::writeMeshCache(const QString &objFilename, IndexOrder order) const
+{
+  if (Q_BYTE_ORDER != Q_LITTLE_ENDIAN)
+    {
+      return true;
+    }
+
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.headerSize = sizeof(Header);
+  header.indexSize = allIndices().bytesPerIndex();
+  header.indexOrder = (quint32)order;
+  header.boundingRadius = boundsRadius;
+  if (!describeSource(objFilename, header))
+    {
+      return false;
+    }
+
+  const void *sections[SectionCount] = {vertices().data(), allIndices().data(),
+                                        normals().data(), texcoords().data(), allMeshlets().data(),
+                                        meshletVertices().data(), meshletTriangles().data(),
+                                        lods().data()};
+  header.counts[Vertices] = vertices().size();
+  header.counts[Indices] = allIndices().size();
+  header.counts[Normals] = normals().size();
+  header.counts[Texcoords] = texcoords().size();
+  header.counts[Meshlets] = allMeshlets().size();
+  header.counts[MeshletVertices] = meshletVertices().size();
+  header.counts[MeshletTriangles] = meshletTriangles().size()/3;
+  header.counts[Lods] = lods().size();
+  qint64 offset = sizeof(Header);
+  for (int s = 0; s < SectionCount; s++)
+    {
+      offset = alignedOffset(offset);
+      header.offsets[s] = offset;
+      offset += header.counts[s]*elementSize(header, s);
+    }
+
+  QSaveFile file(meshCachePath(objFilename));
+  if (!file.open(QIODeviceBase::WriteOnly))
+    {
+      return false;
+    }
+  bool ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header);
+  const char padding[CACHE_LINE_SIZE] = {};
+  for (int s = 0; s < SectionCount && ok; s++)
+    {
+      qint64 gap = header.offsets[s] - file.pos();
+      qint64 bytes = header.counts[s]*elementSize(header, s);
+      ok = file.write(padding, gap) == gap
+        && (bytes == 0 || file.write(static_cast<const char*>(sections[s]), bytes) == bytes);
+    }
+  return ok && file.commit();
+}
@@ -0,0 +1,128 @@
+#include "Meshlet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+void computeBounds(Meshlet &meshlet, ArrayView<QVector3D> vertices, const MeshletList &list)
+{
+  const uint32_t *local = &list.vertices[meshlet.vertexOffset];
+  QVector3D lo = vertices[local[0]], hi = lo;
+  for (int i = 1; i < meshlet.vertexCount; i++)
+    {
+      const QVector3D &v = vertices[local[i]];
+      lo = QVector3D(std::min(lo.x(), v.x()), std::min(lo.y(), v.y()), std::min(lo.z(), v.z()));
+      hi = QVector3D(std::max(hi.x(), v.x()), std::max(hi.y(), v.y()), std::max(hi.z(), v.z()));
+    }
+  QVector3D center = (lo + hi)/2;
+  float radius = 0;
+  for (int i = 0; i < meshlet.vertexCount; i++)
+    {
+      radius = std::max(radius, (vertices[local[i]] - center).length());
+    }
+
+  // The axis is the average normal, and the cone is as wide as the normal furthest from it.
+  // Degenerate triangles have no normal and are never drawn, so they are left out.
+  std::vector<QVector3D> normals;
+  QVector3D axis;
+  const uint8_t *triangles = &list.triangles[3*meshlet.triangleOffset];
+  for (int t = 0; t < meshlet.triangleCount; t++)
+    {
+      const QVector3D &a = vertices[local[triangles[3*t]]];
+      const QVector3D &b = vertices[local[triangles[3*t+1]]];
+      const QVector3D &c = vertices[local[triangles[3*t+2]]];
+      QVector3D n = QVector3D::crossProduct(b - a, c - a);
+      if (n.lengthSquared() > 0)
+        {
+          normals.push_back(n.normalized());
+          axis += normals.back();
+        }
+    }
+  float cutoff = 1;
+  if (axis.lengthSquared() > 0)
+    {
+      axis.normalize();
+      float minDot = 1;
+      for (const QVector3D &n : normals)
+        {
+          minDot = std::min(minDot, QVector3D::dotProduct(n, axis));
+        }
+      if (minDot > 0)
+        {
+          cutoff = std::sqrt(1 - minDot*minDot);
+        }
+    }
+
+  meshlet.center[0] = center.x();
+  meshlet.center[1] = center.y();
+  meshlet.center[2] = center.z();
+  meshlet.radius = radius;
+  meshlet.coneAxis[0] = axis.x();
+  meshlet.coneAxis[1] = axis.y();
+  meshlet.coneAxis[2] = axis.z();
+  meshlet.coneCutoff = cutoff;
+}
+}
+
+MeshletList
+buildMeshlets(ArrayView<QVector3D> vertices, IndexView indices)
+{
+  constexpr uint8_t NOT_IN_MESHLET = 0xff;
+  static_assert(MESHLET_MAX_VERTICES < NOT_IN_MESHLET, "meshlet vertex indices must fit in 8 bits");
+
+  MeshletList list;
+  // Index of every mesh vertex in the current meshlet.
+  std::vector<uint8_t> local(vertices.size(), NOT_IN_MESHLET);
+  Meshlet current = {};
+
+  auto finish = [&]() {
+    for (int i = 0; i < current.vertexCount; i++)
+      {
+        local[list.vertices[current.vertexOffset + i]] = NOT_IN_MESHLET;
+      }
+    computeBounds(current, vertices, list);
+    list.meshlets.append(current);
+    current.vertexOffset = list.vertices.size();
+    current.triangleOffset = list.triangles.size()/3;
+    current.vertexCount = 0;
+    current.triangleCount = 0;
+  };
+
+  for (qsizetype t = 0; t < indices.size()/3; t++)
+    {
+      uint32_t corners[3] = {indices[3*t+0], indices[3*t+1], indices[3*t+2]};
+      int added = 0;
+      for (int i = 0; i < 3; i++)
+        {
+          // A triangle using the same vertex twice adds it once.
+          if (local[corners[i]] == NOT_IN_MESHLET
+              && (i < 1 || corners[i] != corners[0]) && (i < 2 || corners[i] != corners[1]))
+            {
+              added++;
+            }
+        }
+      if (current.vertexCount + added > MESHLET_MAX_VERTICES
+          || current.triangleCount == MESHLET_MAX_TRIANGLES)
+        {
+          finish();
+        }
+
+      for (uint32_t v : corners)
+        {
+          if (local[v] == NOT_IN_MESHLET)
+            {
+              local[v] = current.vertexCount++;
+              list.vertices.append(v);
+            }
+          list.triangles.append(local[v]);
+        }
+      current.triangleCount++;
+    }
+  if (current.triangleCount > 0)
+    {
+      finish();
+    }
+  return list;
+}
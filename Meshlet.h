@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ArrayView.h"
+
+#include <QVector3D>
+#include <QVector>
+#include <cstdint>
+
+// A meshlet is a small cluster of triangles with its own list of vertices, so that its triangles
+// can use 8-bit indices into that list. Drawing a mesh meshlet by meshlet touches few vertices at
+// a time, which keeps them in cache, whatever the size of the mesh.
+constexpr int MESHLET_MAX_VERTICES  = 64;
+constexpr int MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet
+{
+  uint32_t vertexOffset;   // first entry of the meshlet in MeshletList::vertices
+  uint32_t triangleOffset; // first triangle of the meshlet in MeshletList::triangles
+  uint8_t vertexCount;
+  uint8_t triangleCount;
+  uint16_t reserved;
+
+  // Sphere around the vertices, for culling meshlets outside the view.
+  float center[3];
+  float radius;
+  // Cone around the triangle normals: every normal n has dot(n, coneAxis) >= cos(angle), and
+  // coneCutoff is sin(angle), or 1 when the cone is too wide to ever face away from the viewer.
+  float coneAxis[3];
+  float coneCutoff;
+};
+
+struct MeshletList
+{
+  QVector<Meshlet> meshlets;
+  // Mesh vertex index of every meshlet vertex.
+  QVector<uint32_t> vertices;
+  // 3 meshlet vertex indices per triangle.
+  QVector<uint8_t> triangles;
+};
+
+// Splits a triangle list into meshlets and computes their bounds. Triangles are taken in order and
+// added to the current meshlet until it is full, so drawing the meshlets draws the triangles in
+// the same order.
+MeshletList buildMeshlets(ArrayView<QVector3D> vertices, IndexView indices);
@@ -1,140 +1,633 @@
 #include "Model.h"
 
-#include <QTextStream>
 #include <QFile>
+#include <QThread>
+#include <QtCore/qdebug.h>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+Q_LOGGING_CATEGORY(lcModel, "tinyrenderer.model")
 
 namespace
 {
-constexpr int MAX_FACES    = 65536;
-constexpr int MAX_VERTICES = 65536;
-constexpr int MAX_LINESIZE = 1024;
+constexpr int MAX_16BIT_VERTICES = 65536;
+
+inline bool isBlank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Tokenizes one line of the mapped file in place. Numbers are converted with std::from_chars,
+// so nothing is copied or allocated.
+struct LineReader
+{
+  const char *p;
+  const char *end;
+
+  void skipBlanks()
+  {
+    while (p < end && isBlank(*p))
+      {
+        p++;
+      }
+  }
+
+  bool atEnd()
+  {
+    skipBlanks();
+    return p == end;
+  }
+
+  std::string_view word()
+  {
+    skipBlanks();
+    const char *start = p;
+    while (p < end && !isBlank(*p))
+      {
+        p++;
+      }
+    return std::string_view(start, p - start);
+  }
+
+  bool number(float &value)
+  {
+    skipBlanks();
+    if (p < end && *p == '+')
+      {
+        p++; // from_chars doesn't take a plus sign
+      }
+    auto [next, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc() || (next < end && !isBlank(*next)))
+      {
+        return false;
+      }
+    p = next;
+    return true;
+  }
+
+  // One vertex of a face: v, v/vt, v//vn or v/vt/vn. Indices that aren't given are 0.
+  bool corner(long index[3])
+  {
+    skipBlanks();
+    index[0] = index[1] = index[2] = 0;
+    for (int i = 0; i < 3; i++)
+      {
+        if (i > 0)
+          {
+            if (p == end || *p != '/')
+              {
+                break;
+              }
+            p++;
+            if (i == 1 && p < end && *p == '/')
+              {
+                continue; // v//vn
+              }
+          }
+        auto [next, ec] = std::from_chars(p, end, index[i]);
+        if (ec != std::errc())
+          {
+            return false;
+          }
+        p = next;
+      }
+    return p == end || isBlank(*p);
+  }
+};
+
+// OBJ indices start at 1, negative ones count back from the last element read so far.
+bool resolveIndex(long index, int count, int &resolved)
+{
+  long i = index > 0 ? index - 1 : count + index;
+  if (index == 0 || i < 0 || i >= count)
+    {
+      return false;
+    }
+  resolved = i;
+  return true;
+}
+
+template <typename LineFunc>
+void forEachLine(const char *begin, const char *end, LineFunc lineFunc)
+{
+  for (const char *p = begin; p < end; )
+    {
+      const char *eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (eol == nullptr)
+        {
+          eol = end;
+        }
+      if (!lineFunc(LineReader{p, eol}))
+        {
+          return;
+        }
+      p = eol + 1;
+    }
+}
+
+// Number of lines and elements in a part of the file, or before it.
+struct ObjCounts
+{
+  int lines = 0;
+  int vertices = 0;
+  int texcoords = 0;
+  int normals = 0;
+  int triangles = 0;
+};
+
+// Only looks at keywords and counts the vertices of faces, so it is much cheaper than parsing.
+ObjCounts countElements(const char *begin, const char *end)
+{
+  ObjCounts counts;
+  forEachLine(begin, end, [&](LineReader line) {
+    counts.lines++;
+    std::string_view keyword = line.word();
+    if      (keyword == "v")  counts.vertices++;
+    else if (keyword == "vt") counts.texcoords++;
+    else if (keyword == "vn") counts.normals++;
+    else if (keyword == "f")
+      {
+        int corners = 0;
+        while (!line.word().empty())
+          {
+            corners++;
+          }
+        counts.triangles += std::max(corners - 2, 0);
+      }
+    return true;
+  });
+  return counts;
+}
+
+// Where the parsed elements go. The arrays are sized by the counting pass, and every part of the
+// file writes its elements after those of the parts before it.
+struct ObjArrays
+{
+  QVector3D *vertices;
+  QVector2D *texcoords;
+  QVector3D *normals;
+  uint32_t *indices;
+  // Texture coordinate and normal of every index, -1 if the face has none.
+  int *cornerTexcoords;
+  int *cornerNormals;
+};
+
+// Parses a part of the file that starts at a line. base counts everything before it, so indices
+// and line numbers come out the same as when the whole file is parsed in one go. Returns an error
+// message, or an empty string.
+QString parseElements(const char *begin, const char *end, const ObjCounts &base, const ObjArrays &out)
+{
+  ObjCounts n = base;
+  QString error;
+  forEachLine(begin, end, [&](LineReader line) {
+    n.lines++;
+    std::string_view keyword = line.word();
+    if (keyword == "v" || keyword == "vn")
+      {
+        float x, y, z;
+        if (!line.number(x) || !line.number(y) || !line.number(z))
+          {
+            error = QString("Failed to parse a float at line number %1.").arg(n.lines);
+            return false;
+          }
+        if (keyword == "vn")
+          {
+            out.normals[n.normals++] = {x, y, z};
+            return true;
+          }
+        out.vertices[n.vertices++] = {x, y, z};
+      }
+    else if (keyword == "vt")
+      {
+        float u, v = 0;
+        if (!line.number(u) || (!line.atEnd() && !line.number(v)))
+          {
+            error = QString("Failed to parse a float at line number %1.").arg(n.lines);
+            return false;
+          }
+        out.texcoords[n.texcoords++] = {u, v};
+      }
+    else if (keyword == "f")
+      {
+        int corners[3][3]; // first, previous and current vertex of the fan
+        int count = 0;
+        while (!line.atEnd())
+          {
+            long index[3];
+            if (!line.corner(index))
+              {
+                error = QString("Failed to parse an index at line number %1.").arg(n.lines);
+                return false;
+              }
+
+            int *corner = corners[std::min(count, 2)];
+            if (!resolveIndex(index[0], n.vertices, corner[0]))
+              {
+                error = QString("Face at line number %1 refers to a non-existent "
+                                "vertex index (%2). The maximum is %3.")
+                          .arg(n.lines).arg(index[0]).arg(n.vertices);
+                return false;
+              }
+            corner[1] = corner[2] = -1;
+            if (   (index[1] != 0 && !resolveIndex(index[1], n.texcoords, corner[1]))
+                || (index[2] != 0 && !resolveIndex(index[2], n.normals, corner[2])))
+              {
+                error = QString("Face at line number %1 refers to a non-existent "
+                                "texture coordinate or normal index (%2,%3).")
+                          .arg(n.lines).arg(index[1]).arg(index[2]);
+                return false;
+              }
 
-#define DECIMAL_NUMBER_REGEX "[+-]?(?:\\d*)?\\.?(?:\\d*)(?:e[-+]?\\d+)?"
-#define INDEX_GROUP_PATTERN  "(\\d+)\\/(\\d+)\\/(\\d+)"
-constexpr const char *whitespaceOrCommentPattern = "^(?:\\s*#.*)|\\s+$";
-constexpr const char *vPattern = "^v\\s(" DECIMAL_NUMBER_REGEX
-                                 ")\\s+("  DECIMAL_NUMBER_REGEX
-                                 ")\\s+("  DECIMAL_NUMBER_REGEX ")\\s*$";
-constexpr const char *fPattern = "^f\\s+" INDEX_GROUP_PATTERN
-                                 "\\s+"   INDEX_GROUP_PATTERN
-                                 "\\s+"   INDEX_GROUP_PATTERN "\\s*$";
+            if (++count < 3)
+              {
+                continue;
+              }
+            qsizetype first = 3*(qsizetype)n.triangles++;
+            for (int i = 0; i < 3; i++)
+              {
+                out.indices[first + i] = corners[i][0];
+                out.cornerTexcoords[first + i] = corners[i][1];
+                out.cornerNormals[first + i] = corners[i][2];
+              }
+            std::copy(corners[2], corners[2] + 3, corners[1]);
+          }
+        if (count < 3)
+          {
+            error = QString("Face at line number %1 has fewer than 3 vertices.").arg(n.lines);
+            return false;
+          }
+      }
+    // Comments, empty lines, and everything else (groups, materials, ...) are skipped.
+    return true;
+  });
+  return error;
+}
 }
 
-const QVector<QVector3D> &
+ArrayView<QVector3D>
 Model::vertices () const
 {
-  return vertexData;
+  return cacheFile ? cachedVertices : ArrayView<QVector3D>(vertexData);
+}
+
+IndexView
+Model::allIndices () const
+{
+  if (cacheFile)
+    {
+      return cachedIndices;
+    }
+  return vertexData.size() <= MAX_16BIT_VERTICES ? IndexView(indexData16) : IndexView(indexData32);
+}
+
+IndexView
+Model::indices (int lod) const
+{
+  ArrayView<ModelLod> levels = lods();
+  if (levels.isEmpty())
+    {
+      return allIndices();
+    }
+  return allIndices().sliced(levels[lod].firstIndex, levels[lod].indexCount);
+}
+
+ArrayView<QVector3D>
+Model::normals () const
+{
+  return cacheFile ? cachedNormals : ArrayView<QVector3D>(normalData);
+}
+
+ArrayView<QVector2D>
+Model::texcoords () const
+{
+  return cacheFile ? cachedTexcoords : ArrayView<QVector2D>(texcoordData);
+}
+
+ArrayView<Meshlet>
+Model::allMeshlets () const
+{
+  return cacheFile ? cachedMeshlets : ArrayView<Meshlet>(meshletData.meshlets);
+}
+
+ArrayView<Meshlet>
+Model::meshlets (int lod) const
+{
+  ArrayView<ModelLod> levels = lods();
+  if (levels.isEmpty())
+    {
+      return allMeshlets();
+    }
+  return allMeshlets().sliced(levels[lod].firstMeshlet, levels[lod].meshletCount);
+}
+
+ArrayView<uint32_t>
+Model::meshletVertices () const
+{
+  return cacheFile ? cachedMeshletVertices : ArrayView<uint32_t>(meshletData.vertices);
+}
+
+ArrayView<uint8_t>
+Model::meshletTriangles () const
+{
+  return cacheFile ? cachedMeshletTriangles : ArrayView<uint8_t>(meshletData.triangles);
 }
 
-const QVector<uint16_t> &
-Model::indices () const
+ArrayView<ModelLod>
+Model::lods () const
 {
-  return indexData;
+  return cacheFile ? cachedLods : ArrayView<ModelLod>(lodData);
+}
+
+int
+Model::selectLod (float screenRadius, float maxErrorPixels) const
+{
+  // The errors grow with every LOD.
+  ArrayView<ModelLod> levels = lods();
+  for (int lod = levels.size() - 1; lod > 0; lod--)
+    {
+      if (levels[lod].error*screenRadius <= maxErrorPixels)
+        {
+          return lod;
+        }
+    }
+  return 0;
 }
 
+void
+Model::setLods (const std::vector<QVector<uint32_t>> &lodIndices, const std::vector<float> &errors)
+{
+  QVector3D lo, hi;
+  if (!vertexData.isEmpty())
+    {
+      lo = hi = vertexData[0];
+    }
+  for (const QVector3D &v : vertexData)
+    {
+      lo = QVector3D(std::min(lo.x(), v.x()), std::min(lo.y(), v.y()), std::min(lo.z(), v.z()));
+      hi = QVector3D(std::max(hi.x(), v.x()), std::max(hi.y(), v.y()), std::max(hi.z(), v.z()));
+    }
+  boundsRadius = 0;
+  for (const QVector3D &v : vertexData)
+    {
+      boundsRadius = std::max(boundsRadius, (v - (lo + hi)/2).length());
+    }
 
+  // 16-bit indices when they are enough, which halves the memory they take.
+  bool compact = vertexData.size() <= MAX_16BIT_VERTICES;
+  indexData16.clear();
+  indexData32.clear();
+  meshletData = {};
+  lodData.clear();
+  for (size_t l = 0; l < lodIndices.size(); l++)
+    {
+      const QVector<uint32_t> &indices = lodIndices[l];
+      ModelLod lod;
+      lod.firstIndex = compact ? indexData16.size() : indexData32.size();
+      lod.indexCount = indices.size();
+      lod.vertexCount = vertexData.size();
+      if (l > 0)
+        {
+          lod.vertexCount = indices.isEmpty() ? 0 : *std::max_element(indices.begin(), indices.end()) + 1;
+        }
+      lod.error = errors[l];
+      if (compact)
+        {
+          indexData16.append(QVector<uint16_t>(indices.begin(), indices.end()));
+        }
+      else
+        {
+          indexData32.append(indices);
+        }
+
+      // The meshlets of every LOD are appended to the same arrays.
+      MeshletList meshlets = buildMeshlets(vertexData, ArrayView<uint32_t>(indices));
+      lod.firstMeshlet = meshletData.meshlets.size();
+      lod.meshletCount = meshlets.meshlets.size();
+      for (Meshlet meshlet : meshlets.meshlets)
+        {
+          meshlet.vertexOffset += meshletData.vertices.size();
+          meshlet.triangleOffset += meshletData.triangles.size()/3;
+          meshletData.meshlets.append(meshlet);
+        }
+      meshletData.vertices.append(meshlets.vertices);
+      meshletData.triangles.append(meshlets.triangles);
+      lodData.append(lod);
+    }
+}
+
+void
+Model::renumberVertices (const std::vector<uint32_t> &remap)
+{
+  auto permute = [&remap](auto &data) {
+    auto permuted = data;
+    for (qsizetype v = 0; v < data.size(); v++)
+      {
+        permuted[remap[v]] = data[v];
+      }
+    data = std::move(permuted);
+  };
+  permute(vertexData);
+  permute(normalData);
+  permute(texcoordData);
+}
+
+void
+Model::detach ()
+{
+  if (!cacheFile)
+    {
+      return;
+    }
+  vertexData = QVector<QVector3D>(cachedVertices.begin(), cachedVertices.end());
+  normalData = QVector<QVector3D>(cachedNormals.begin(), cachedNormals.end());
+  texcoordData = QVector<QVector2D>(cachedTexcoords.begin(), cachedTexcoords.end());
+  std::vector<QVector<uint32_t>> lodIndices;
+  std::vector<float> errors;
+  for (int lod = 0; lod < lods().size(); lod++)
+    {
+      IndexView indices = this->indices(lod);
+      lodIndices.emplace_back(indices.size());
+      for (qsizetype i = 0; i < indices.size(); i++)
+        {
+          lodIndices.back()[i] = indices[i];
+        }
+      errors.push_back(lods()[lod].error);
+    }
+  cacheFile.reset();
+  setLods(lodIndices, errors);
+}
+
+std::optional<Model>
+Model::load(const QString &filename, IndexOrder order)
+{
+  std::optional<Model> model = readMeshCache(filename, order);
+  if (model.has_value())
+    {
+      return model;
+    }
+  model = readObjFile(filename);
+  if (model.has_value() && order == IndexOrder::Optimized)
+    {
+      IndexOrderStats stats = model->optimizeIndexOrder();
+      qCInfo(lcModel) << QString("Reordered the triangles of %1: ACMR %2 -> %3, overdraw %4 -> %5.")
+                         .arg(filename).arg(stats.acmrBefore, 0, 'f', 3).arg(stats.acmrAfter, 0, 'f', 3)
+                         .arg(stats.overdrawBefore, 0, 'f', 3).arg(stats.overdrawAfter, 0, 'f', 3);
+    }
+  if (model.has_value())
+    {
+      model->generateLods();
+      qCInfo(lcModel) << QString("Generated %1 LODs of %2, down to %3 triangles.").arg(model->lods().size())
+                         .arg(filename).arg(model->indices(model->lods().size() - 1).size()/3);
+    }
+  if (model.has_value() && !model->writeMeshCache(filename, order))
+    {
+      qWarning() << QString("Could not write the mesh cache %1.").arg(meshCachePath(filename));
+    }
+  return model;
+}
+
+// The file is memory mapped and parsed in place. v, vt, vn and f lines may come in any order,
+// faces with more than 3 vertices are split into a fan, and other statements are ignored.
+//
+// Parsing is done in two passes over parts of the file that start and end at line boundaries:
+// the first counts the elements of every part, which gives each part its place in the arrays, and
+// the second fills them in. With ObjLoading::Parallel the parts are processed on all cores.
 std::optional<Model>
-Model::readObjFile(const QString &filename)
+Model::readObjFile(const QString &filename, ObjLoading loading)
 {
   QFile file(filename);
-  if (!file.open(QIODeviceBase::ReadOnly | QIODevice::Text))
+  if (!file.open(QIODeviceBase::ReadOnly))
     {
       return {};
     }
+  qint64 size = file.size();
+  if (size == 0)
+    {
+      return Model();
+    }
+  const char *data = reinterpret_cast<const char*>(file.map(0, size));
+  if (data == nullptr)
+    {
+      qWarning() << QString("Failed to map %1.").arg(filename);
+      return {};
+    }
+  const char *end = data + size;
+
+  // A few parts per core so that the dynamic schedule can even out their differences.
+  constexpr qint64 MIN_PART_SIZE = 1 << 20;
+  int parts = 1;
+  if (loading == ObjLoading::Parallel)
+    {
+      parts = std::clamp<qint64>(size/MIN_PART_SIZE, 1, 4*QThread::idealThreadCount());
+    }
+  std::vector<const char*> bounds(parts + 1, end);
+  bounds[0] = data;
+  for (int i = 1; i < parts; i++)
+    {
+      const char *p = std::max(data + size*i/parts, bounds[i-1]);
+      const char *eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      bounds[i] = eol == nullptr ? end : eol + 1;
+    }
 
-  QRegularExpression commentRegex(whitespaceOrCommentPattern);
-  QRegularExpression vRegex(vPattern);
-  QRegularExpression fRegex(fPattern);
+  std::vector<ObjCounts> counts(parts + 1);
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < parts; i++)
+    {
+      counts[i+1] = countElements(bounds[i], bounds[i+1]);
+    }
+  // counts[i] becomes the number of elements before part i.
+  for (int i = 1; i <= parts; i++)
+    {
+      counts[i].lines     += counts[i-1].lines;
+      counts[i].vertices  += counts[i-1].vertices;
+      counts[i].texcoords += counts[i-1].texcoords;
+      counts[i].normals   += counts[i-1].normals;
+      counts[i].triangles += counts[i-1].triangles;
+    }
+  const ObjCounts &total = counts[parts];
 
   Model model;
-  bool readingVertices = true;
-  bool readingFaces = false;
-  QTextStream ts(&file);
-  int lineNumber = 0;
-  int ignoredFaces = 0;
-  while (!ts.atEnd())
-    {
-      QString line = ts.readLine(MAX_LINESIZE);
-      lineNumber++;
-
-      QRegularExpressionMatch commentMatch = commentRegex.match(line);
-      if (commentMatch.hasMatch() || line.isEmpty())
+  model.vertexData.resize(total.vertices);
+  QVector<uint32_t> indices(3*(qsizetype)total.triangles);
+  QVector<QVector3D> fileNormals(total.normals);
+  QVector<QVector2D> fileTexcoords(total.texcoords);
+  std::vector<int> cornerTexcoords(indices.size());
+  std::vector<int> cornerNormals(indices.size());
+  ObjArrays arrays = {model.vertexData.data(), fileTexcoords.data(), fileNormals.data(),
+                      indices.data(), cornerTexcoords.data(), cornerNormals.data()};
+
+  std::vector<QString> errors(parts);
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < parts; i++)
+    {
+      errors[i] = parseElements(bounds[i], bounds[i+1], counts[i], arrays);
+    }
+  // The first error in the file is the one a serial parser would have stopped at.
+  for (const QString &error : errors)
+    {
+      if (!error.isEmpty())
         {
-          continue;
+          qWarning() << error;
+          return {};
         }
-      if (readingVertices)
+    }
+
+  // The renderer indexes everything by vertex, so the per-corner attributes are merged into
+  // per-vertex ones.
+  auto given = [](int index) { return index >= 0; };
+  if (std::any_of(cornerNormals.begin(), cornerNormals.end(), given))
+    {
+      model.normalData.resize(model.vertexData.size());
+      for (qsizetype i = 0; i < indices.size(); i++)
         {
-          QRegularExpressionMatch vMatch = vRegex.match(line);
-          if (vMatch.hasMatch())
+          if (cornerNormals[i] >= 0)
             {
-              if (model.vertexData.size() == MAX_VERTICES)
-                {
-                  qWarning() << QString("Vertex at line number %1 would exceed maximum number of vertices (%2).")
-                                  .arg(lineNumber).arg(MAX_VERTICES);
-                  return {};
-                }
-              bool okx, oky, okz;
-              float x = vMatch.captured(1).toFloat(&okx);
-              float y = vMatch.captured(2).toFloat(&oky);
-              float z = vMatch.captured(3).toFloat(&okz);
-              if (!okx || !oky || !okz)
-                {
-                  qWarning() << QString("Failed to parse a float at line number %1 (%2,%3,%4).")
-                                  .arg(lineNumber).arg(okx).arg(oky).arg(okz);
-                  return {};
-                }
-              model.vertexData.append({x, y, z});
-            }
-          else
-            {
-              readingVertices = false;
+              model.normalData[indices[i]] += fileNormals[cornerNormals[i]];
             }
         }
-      QRegularExpressionMatch fMatch = fRegex.match(line);
-      if (fMatch.hasMatch())
+      for (QVector3D &n : model.normalData)
         {
-          readingFaces = true;
-          if (model.indexData.size() == 3*MAX_FACES)
-            {
-              qWarning() << QString("Face at line number %1 would exceed maximum number of faces (%2).")
-              .arg(lineNumber).arg(MAX_FACES);
-              return {};
-            }
-          bool ok0, ok1, ok2;
-          int v0 = fMatch.captured(1).toInt(&ok0);
-          int v1 = fMatch.captured(4).toInt(&ok1);
-          int v2 = fMatch.captured(7).toInt(&ok2);
-
-          if (!ok0 || !ok1 || !ok2)
-            {
-              qWarning() << QString("Failed to parse an index at line number %1 (%2,%3,%4).")
-              .arg(lineNumber).arg(ok0).arg(ok1).arg(ok2);
-              return {};
-            }
-
-          v0--;
-          v1--;
-          v2--;
-
-          int maxIndex = model.vertexData.size()-1;
-          if (   !(0 <= v0 && v0 <= maxIndex)
-              || !(0 <= v1 && v1 <= maxIndex)
-              || !(0 <= v2 && v2 <= maxIndex))
+          n.normalize();
+        }
+    }
+  else
+    {
+      // Without normals in the file, a vertex gets the average of its faces' normals, weighted
+      // by their areas, which is what the unnormalized cross products are.
+      model.normalData.resize(model.vertexData.size());
+      for (qsizetype i = 0; i < indices.size(); i += 3)
+        {
+          const QVector3D &p = model.vertexData[indices[i]];
+          QVector3D n = QVector3D::crossProduct(model.vertexData[indices[i+1]] - p, model.vertexData[indices[i+2]] - p);
+          for (int k = 0; k < 3; k++)
             {
-              qWarning() << QString("Face at line number %1 refers to a non-existent "
-                                      "vertex index (%2,%3,%4). The maximum is %5.")
-                                 .arg(lineNumber).arg(v0).arg(v1).arg(v2).arg(maxIndex);
-              return {};
+              model.normalData[indices[i+k]] += n;
             }
-          model.indexData.append(v0);
-          model.indexData.append(v1);
-          model.indexData.append(v2);
         }
-      else if (readingFaces)
+      for (QVector3D &n : model.normalData)
         {
-          ignoredFaces++;
+          n.normalize();
         }
     }
+  if (std::any_of(cornerTexcoords.begin(), cornerTexcoords.end(), given))
+    {
+      model.texcoordData.resize(model.vertexData.size());
+      std::vector<bool> assigned(model.vertexData.size());
+      for (qsizetype i = 0; i < indices.size(); i++)
+        {
+          int v = indices[i];
+          if (cornerTexcoords[i] >= 0 && !assigned[v])
+            {
+              model.texcoordData[v] = fileTexcoords[cornerTexcoords[i]];
+              assigned[v] = true;
+            }
+        }
+    }
+
+  model.setLods({std::move(indices)}, {0.0f});
 
   return model;
 }
@@ -1,22 +1,131 @@
 #pragma once
 
+#include "ArrayView.h"
+#include "IndexOrder.h"
+#include "Meshlet.h"
+
+#include <QFile>
+#include <QLoggingCategory>
 #include <QString>
+#include <QVector2D>
 #include <QVector3D>
 #include <QVector>
 #include <cstdint>
+#include <memory>
 #include <optional>
-#include <QRegularExpression.h>
+#include <vector>
+
+// "tinyrenderer.model": what Model::load() does to a model it parses, at the info level. Batch
+// tools turn it off.
+Q_DECLARE_LOGGING_CATEGORY(lcModel)
+
+// How readObjFile() uses the cores. Both produce the same Model.
+enum class ObjLoading
+{
+  Serial,
+  Parallel,
+};
+
+// Order of the triangles and vertices of a Model.
+enum class IndexOrder
+{
+  File,      // as in the OBJ file
+  Optimized, // see optimizeIndexOrder()
+};
+
+// A level of detail of a Model: a range of its indices and meshlets. Coarser LODs use fewer
+// vertices, and every LOD only uses the first vertexCount ones.
+struct ModelLod
+{
+  uint32_t firstIndex, indexCount;
+  uint32_t firstMeshlet, meshletCount;
+  uint32_t vertexCount;
+  // Largest distance from the full mesh, relative to the bounding radius.
+  float error;
+};
 
+// A triangle mesh. The arrays are either owned by the Model or mapped from a mesh cache file.
 class Model
 {
 public:
   Model() {};
-  const QVector<QVector3D> &vertices() const;
-  const QVector<uint16_t> &indices() const;
+  ArrayView<QVector3D> vertices() const;
+  // 3 per triangle of a LOD. They are 16-bit when the mesh has at most 65536 vertices, 32-bit
+  // otherwise.
+  IndexView indices(int lod = 0) const;
 
-  static std::optional<Model> readObjFile(const QString &filename);
+  // One per vertex. Normals are the average of the normals given for the vertex in its faces,
+  // or of the normals of the faces when the file has none. Texture coordinates are the first ones
+  // given, or empty when the file has none.
+  ArrayView<QVector3D> normals() const;
+  ArrayView<QVector2D> texcoords() const;
+
+  // The triangles of a LOD split into meshlets, in the same order as indices(). See Meshlet.h.
+  ArrayView<Meshlet> meshlets(int lod = 0) const;
+  ArrayView<uint32_t> meshletVertices() const;
+  ArrayView<uint8_t> meshletTriangles() const;
+
+  // LOD 0 is the full mesh, and every other one has about half the triangles of the one before.
+  ArrayView<ModelLod> lods() const;
+  // Radius of a sphere around the center of the bounding box that holds every vertex.
+  float boundingRadius() const { return boundsRadius; }
+
+  // The coarsest LOD whose error stays within maxErrorPixels when the bounding radius is
+  // screenRadius pixels long on screen.
+  int selectLod(float screenRadius, float maxErrorPixels = 1.0f) const;
+
+  // Replaces the LODs other than the full mesh by a chain of simplifications of it (see
+  // Simplify.h). The vertices are renumbered so that the ones used by coarser LODs come first.
+  void generateLods();
+
+  // Reorders the triangles for vertex cache locality and less overdraw, and renumbers the
+  // vertices in the order the triangles use them (see IndexOrder.h). Returns the cache miss ratio
+  // and overdraw before and after. Only the full mesh is kept: generate the LODs afterwards.
+  IndexOrderStats optimizeIndexOrder();
+
+  // Reads an OBJ file through its mesh cache (see MeshCache.cpp): a valid cache next to the file
+  // is mapped instead of parsing the file, and a missing or stale one is rewritten with the LODs
+  // of the model. The cache keeps the index order it was written with.
+  static std::optional<Model> load(const QString &filename, IndexOrder order = IndexOrder::File);
+
+  static std::optional<Model> readObjFile(const QString &filename,
+                                          ObjLoading loading = ObjLoading::Parallel);
 
 private:
+  static QString meshCachePath(const QString &objFilename);
+  static std::optional<Model> readMeshCache(const QString &objFilename, IndexOrder order);
+  bool writeMeshCache(const QString &objFilename, IndexOrder order) const;
+
+  IndexView allIndices() const;
+  ArrayView<Meshlet> allMeshlets() const;
+
+  // Stores the indices of the LODs in the smallest format that fits and splits them into
+  // meshlets. errors are those of the LODs, relative to the bounding radius.
+  void setLods(const std::vector<QVector<uint32_t>> &lodIndices, const std::vector<float> &errors);
+  // Moves vertex v to remap[v], with its attributes.
+  void renumberVertices(const std::vector<uint32_t> &remap);
+  // Replaces views into a mesh cache by owned copies of the arrays.
+  void detach();
+
   QVector<QVector3D> vertexData;
-  QVector<uint16_t> indexData;
+  // Only one of them is used, depending on the number of vertices.
+  QVector<uint16_t> indexData16;
+  QVector<uint32_t> indexData32;
+  QVector<QVector3D> normalData;
+  QVector<QVector2D> texcoordData;
+  MeshletList meshletData;
+  QVector<ModelLod> lodData;
+  float boundsRadius = 0;
+
+  // Set for a Model read from a mesh cache. The views point into the mapping, which lives as long
+  // as any copy of the Model.
+  std::shared_ptr<QFile> cacheFile;
+  ArrayView<QVector3D> cachedVertices;
+  IndexView cachedIndices;
+  ArrayView<QVector3D> cachedNormals;
+  ArrayView<QVector2D> cachedTexcoords;
+  ArrayView<Meshlet> cachedMeshlets;
+  ArrayView<uint32_t> cachedMeshletVertices;
+  ArrayView<uint8_t> cachedMeshletTriangles;
+  ArrayView<ModelLod> cachedLods;
 };
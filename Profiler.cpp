@@ -0,0 +1,271 @@
+#include "Profiler.h"
+#include "FrameBuffer.h"
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace Profiler
+{
+namespace
+{
+// Frames kept for the trace. At a few events per frame this is a few MB at most.
+constexpr size_t MAX_TRACE_FRAMES = 10000;
+
+struct StageEvent
+{
+  Stage stage;
+  qint64 start, duration; // ns since the epoch
+};
+
+struct FrameRecord
+{
+  quint64 number;
+  qint64 start, end;
+  std::vector<StageEvent> stages;
+  FrameProfile profile;
+};
+
+struct State
+{
+  QElapsedTimer epoch;
+  QMutex mutex;
+  QAtomicInteger<quint64> counters[int(Counter::Count)];
+  FrameRecord current{};
+  FrameProfile last;
+  quint64 frames = 0;
+  std::deque<FrameRecord> trace;
+
+  State() { epoch.start(); }
+  qint64 now() const { return epoch.nsecsElapsed(); }
+};
+
+State &state()
+{
+  static State s;
+  return s;
+}
+
+// Scopes open on this thread.
+thread_local int openScopes = 0;
+}
+
+const char *
+stageName(Stage stage)
+{
+  switch (stage)
+    {
+    case Stage::Clear:           return "Clear";
+    case Stage::ShadowMap:       return "Shadow map";
+    case Stage::VertexTransform: return "Vertex transform";
+    case Stage::TriangleSetup:   return "Triangle setup";
+    case Stage::Rasterization:   return "Rasterization";
+    case Stage::Resolve:         return "Resolve";
+    case Stage::Present:         return "Present";
+    case Stage::Count:           break;
+    }
+  return "?";
+}
+
+const char *
+counterName(Counter counter)
+{
+  switch (counter)
+    {
+    case Counter::TrianglesSubmitted:   return "Triangles submitted";
+    case Counter::TrianglesCulled:      return "Triangles culled";
+    case Counter::TrianglesRasterized:  return "Triangles rasterized";
+    case Counter::PixelsTested:         return "Pixels tested";
+    case Counter::PixelsWritten:        return "Pixels written";
+    case Counter::PixelsShaded:         return "Pixels shaded";
+    case Counter::HiZTrianglesRejected: return "Hi-Z triangles rejected";
+    case Counter::HiZBlocksRejected:    return "Hi-Z blocks rejected";
+    case Counter::HiZBlocksAccepted:    return "Hi-Z blocks accepted";
+    case Counter::Count:                break;
+    }
+  return "?";
+}
+
+qint64
+FrameProfile::totalNs() const
+{
+  qint64 total = 0;
+  for (qint64 ns : stageNs)
+    {
+      total += ns;
+    }
+  return total;
+}
+
+double
+FrameProfile::overdraw() const
+{
+  return coveredPixels > 0 ? double(counter(Counter::PixelsWritten))/coveredPixels : 0;
+}
+
+void
+beginFrame()
+{
+  State &s = state();
+  for (QAtomicInteger<quint64> &c : s.counters)
+    {
+      c.storeRelaxed(0);
+    }
+  QMutexLocker locker(&s.mutex);
+  s.current = FrameRecord{};
+  s.current.number = s.frames++;
+  s.current.start = s.now();
+}
+
+FrameProfile
+endFrame()
+{
+  State &s = state();
+  QMutexLocker locker(&s.mutex);
+  s.current.end = s.now();
+  for (int i = 0; i < int(Counter::Count); i++)
+    {
+      s.current.profile.counters[i] = s.counters[i].loadRelaxed();
+    }
+  s.last = s.current.profile;
+  s.trace.push_back(std::move(s.current));
+  if (s.trace.size() > MAX_TRACE_FRAMES)
+    {
+      s.trace.pop_front();
+    }
+  return s.last;
+}
+
+FrameProfile
+lastFrame()
+{
+  State &s = state();
+  QMutexLocker locker(&s.mutex);
+  return s.last;
+}
+
+void
+countCoveredPixels(const FrameBuffer &fb)
+{
+  quint64 covered = 0;
+  for (int y = 0; y < fb.height(); y++)
+    {
+      const QRgb *row = fb.colorRow(y);
+      for (int x = 0; x < fb.width(); x++)
+        {
+          covered += qAlpha(row[x]) != 0;
+        }
+    }
+  State &s = state();
+  QMutexLocker locker(&s.mutex);
+  s.current.profile.coveredPixels = covered;
+}
+
+void
+add(Counter counter, quint64 n)
+{
+  state().counters[int(counter)].fetchAndAddRelaxed(n);
+}
+
+Scope::Scope(Stage stage)
+    : stage(stage), start(state().now()), outermost(openScopes++ == 0)
+{
+  if (stage == Stage::ShadowMap)
+    {
+      for (int i = 0; i < int(Counter::Count); i++)
+        {
+          countersAtStart[i] = state().counters[i].loadRelaxed();
+        }
+    }
+}
+
+Scope::~Scope()
+{
+  State &s = state();
+  qint64 duration = s.now() - start;
+  openScopes--;
+  // The pass is over, so nothing else counts while the counters are put back.
+  if (stage == Stage::ShadowMap)
+    {
+      for (int i = 0; i < int(Counter::Count); i++)
+        {
+          s.counters[i].storeRelaxed(countersAtStart[i]);
+        }
+    }
+  QMutexLocker locker(&s.mutex);
+  if (outermost)
+    {
+      s.current.profile.stageNs[int(stage)] += duration;
+    }
+  s.current.stages.push_back({stage, start, duration});
+}
+
+bool
+writeChromeTrace(const QString &filename)
+{
+  State &s = state();
+  QMutexLocker locker(&s.mutex);
+
+  // Times are in microseconds. Every frame is a span on one track with its stages nested inside,
+  // and the counters are sampled at the end of the frame.
+  std::string json = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+  char event[512];
+  auto append = [&](bool first) { json += first ? "  " : ",\n  "; json += event; };
+  bool first = true;
+  for (const FrameRecord &frame : s.trace)
+    {
+      std::snprintf(event, sizeof event,
+                    "{\"name\": \"Frame %llu\", \"cat\": \"frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+                    "\"ts\": %.3f, \"dur\": %.3f}",
+                    (unsigned long long)frame.number, frame.start/1e3, (frame.end - frame.start)/1e3);
+      append(first);
+      first = false;
+      for (const StageEvent &stage : frame.stages)
+        {
+          std::snprintf(event, sizeof event,
+                        "{\"name\": \"%s\", \"cat\": \"stage\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+                        "\"ts\": %.3f, \"dur\": %.3f}",
+                        stageName(stage.stage), stage.start/1e3, stage.duration/1e3);
+          append(false);
+        }
+      const FrameProfile &p = frame.profile;
+      std::snprintf(event, sizeof event,
+                    "{\"name\": \"Triangles\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": "
+                    "{\"submitted\": %llu, \"culled\": %llu, \"rasterized\": %llu}}",
+                    frame.end/1e3, (unsigned long long)p.counter(Counter::TrianglesSubmitted),
+                    (unsigned long long)p.counter(Counter::TrianglesCulled),
+                    (unsigned long long)p.counter(Counter::TrianglesRasterized));
+      append(false);
+      std::snprintf(event, sizeof event,
+                    "{\"name\": \"Pixels\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": "
+                    "{\"tested\": %llu, \"written\": %llu, \"shaded\": %llu, \"covered\": %llu}}",
+                    frame.end/1e3, (unsigned long long)p.counter(Counter::PixelsTested),
+                    (unsigned long long)p.counter(Counter::PixelsWritten),
+                    (unsigned long long)p.counter(Counter::PixelsShaded),
+                    (unsigned long long)p.coveredPixels);
+      append(false);
+      std::snprintf(event, sizeof event,
+                    "{\"name\": \"Hi-Z\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": "
+                    "{\"triangles rejected\": %llu, \"blocks rejected\": %llu, \"blocks accepted\": %llu}}",
+                    frame.end/1e3, (unsigned long long)p.counter(Counter::HiZTrianglesRejected),
+                    (unsigned long long)p.counter(Counter::HiZBlocksRejected),
+                    (unsigned long long)p.counter(Counter::HiZBlocksAccepted));
+      append(false);
+      std::snprintf(event, sizeof event,
+                    "{\"name\": \"Overdraw\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": "
+                    "{\"ratio\": %.4f}}",
+                    frame.end/1e3, p.overdraw());
+      append(false);
+    }
+  json += "\n]}\n";
+
+  QFile file(filename);
+  return file.open(QIODevice::WriteOnly) && file.write(json.c_str(), json.size()) == qint64(json.size());
+}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <QString>
+#include <QtGlobal>
+#include <array>
+
+class FrameBuffer;
+
+// Per-frame timings of the pipeline stages and work counters, with an export to the Chrome trace
+// event format (chrome://tracing, Perfetto).
+//
+// The pipeline only uses the PROFILE_* macros, which compile to nothing unless
+// TINYRENDERER_PROFILING is defined, so a build without it has no profiling cost at all. The
+// functions below stay available either way and just see empty frames.
+namespace Profiler
+{
+enum class Stage
+{
+  Clear,           // color and depth buffers
+  // The shadow map, drawn from the light with every stage below. Its counters aren't counted,
+  // so they describe the view.
+  ShadowMap,
+  VertexTransform, // meshlet culling and the vertex stage
+  TriangleSetup,   // triangle assembly, clipping and binning
+  Rasterization,   // the tiles, including the depth test where it is on
+  Resolve,         // shading the G-buffer of a deferred draw, or averaging the samples
+  Present,         // showing or writing the image
+  Count
+};
+
+enum class Counter
+{
+  TrianglesSubmitted,   // to the tile binner
+  TrianglesCulled,      // before the binner: in culled meshlets, or off the screen
+  TrianglesRasterized,  // rasterizer calls past back-face culling and clipping, once per tile
+  PixelsTested,         // covered by a triangle, going through the depth test if there is one
+  PixelsWritten,
+  PixelsShaded,         // by a fragment shader: those written, or the visible ones when deferred
+  // Coarse depth test, when it is on. Counted like TrianglesRasterized, once per tile.
+  HiZTrianglesRejected, // every block of the triangle behind what is drawn
+  HiZBlocksRejected,
+  HiZBlocksAccepted,    // covered and in front, written without per-pixel tests
+  Count
+};
+
+const char *stageName(Stage stage);
+const char *counterName(Counter counter);
+
+struct FrameProfile
+{
+  // Stages nested in another one on the same thread, like those of the shadow map, only count
+  // toward the outer stage. The trace has them all.
+  std::array<qint64, int(Stage::Count)> stageNs{};
+  std::array<quint64, int(Counter::Count)> counters{};
+  // Pixels of the frame covered by anything, from countCoveredPixels().
+  quint64 coveredPixels = 0;
+
+  qint64 totalNs() const;
+  quint64 counter(Counter c) const { return counters[int(c)]; }
+  // Pixels written per covered pixel: 1 means nothing was drawn over.
+  double overdraw() const;
+};
+
+// Frames are delimited by beginFrame() and endFrame(), on the thread that draws.
+void beginFrame();
+FrameProfile endFrame();
+// The last frame returned by endFrame().
+FrameProfile lastFrame();
+
+// Counts the pixels that are not transparent, for FrameProfile::overdraw(). Only meaningful when
+// the buffer was cleared to a transparent color.
+void countCoveredPixels(const FrameBuffer &fb);
+
+// Adds to a counter of the current frame. Safe from any thread.
+void add(Counter counter, quint64 n);
+
+// Times a stage from construction to destruction.
+class Scope
+{
+public:
+  explicit Scope(Stage stage);
+  ~Scope();
+  Scope(const Scope&) = delete;
+  Scope &operator=(const Scope&) = delete;
+
+private:
+  Stage stage;
+  qint64 start;
+  bool outermost;
+  std::array<quint64, int(Counter::Count)> countersAtStart; // for Stage::ShadowMap
+};
+
+// Writes the stages and counters of the frames recorded so far (the most recent ones, up to a
+// limit) as Chrome trace events.
+bool writeChromeTrace(const QString &filename);
+}
+
+#ifdef TINYRENDERER_PROFILING
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) Profiler::Scope PROFILE_CONCAT(profileScope, __LINE__)(Profiler::Stage::stage)
+#define PROFILE_COUNT(counter, n) Profiler::add(Profiler::Counter::counter, (n))
+#else
+#define PROFILE_SCOPE(stage)
+// The count is still evaluated, so the variables it uses don't look unused, but it has no side
+// effects and the compiler drops it along with whatever only fed it.
+#define PROFILE_COUNT(counter, n) ((void)(n))
+#endif
@@ -0,0 +1,549 @@
+#include "RasterKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace RasterKernels
+{
+namespace
+{
+// Row-major walk with incremental stepping, the same setup as the vector paths.
+int fillScalar(const EdgeSetup &s, QRgb c, QRgb *row, std::ptrdiff_t pitch)
+{
+  int written = 0;
+  int e0 = s.e[0];
+  int e1 = s.e[1];
+  int e2 = s.e[2];
+  for (int y = s.miny; y <= s.maxy; y++)
+    {
+      int x0 = e0;
+      int x1 = e1;
+      int x2 = e2;
+      for (int x = s.minx; x <= s.maxx; x++)
+        {
+          if ((x0 & x1 & x2) < 0)
+            {
+              row[x] = c;
+              written++;
+            }
+          x0 += s.stepX[0];
+          x1 += s.stepX[1];
+          x2 += s.stepX[2];
+        }
+      e0 += s.stepY[0];
+      e1 += s.stepY[1];
+      e2 += s.stepY[2];
+      row += pitch;
+    }
+  return written;
+}
+
+// The same walk for depth only, with the depth math of the raster pipeline.
+template <DepthFormat F>
+DepthCounts depthScalar(const DepthSetup &s, void *depth, std::ptrdiff_t pitch)
+{
+  using Traits = DepthTraits<F>;
+  using Type = typename Traits::Type;
+  const EdgeSetup &edges = s.edges;
+  Type *row = static_cast<Type*>(depth);
+  DepthCounts counts = {0, 0};
+  int e0 = edges.e[0];
+  int e1 = edges.e[1];
+  int e2 = edges.e[2];
+  for (int y = edges.miny; y <= edges.maxy; y++)
+    {
+      float rowZ = s.z + (y - s.y0)*s.stepY;
+      int x0 = e0;
+      int x1 = e1;
+      int x2 = e2;
+      for (int x = edges.minx; x <= edges.maxx; x++)
+        {
+          if ((x0 & x1 & x2) < 0)
+            {
+              counts.tested++;
+              Type d = Traits::encode(rowZ + (x - s.x0)*s.stepX);
+              if (depthPasses<F>(d, row[x]))
+                {
+                  row[x] = d;
+                  counts.written++;
+                }
+            }
+          x0 += edges.stepX[0];
+          x1 += edges.stepX[1];
+          x2 += edges.stepX[2];
+        }
+      e0 += edges.stepY[0];
+      e1 += edges.stepY[1];
+      e2 += edges.stepY[2];
+      row += pitch;
+    }
+  return counts;
+}
+
+template <int SAMPLES>
+void resolveScalar(const QRgb *samples, QRgb *pixels, int count)
+{
+  for (int i = 0; i < count; i++)
+    {
+      int a = SAMPLES/2, r = SAMPLES/2, g = SAMPLES/2, b = SAMPLES/2;
+      for (int s = 0; s < SAMPLES; s++)
+        {
+          QRgb c = samples[s];
+          a += qAlpha(c);
+          r += qRed(c);
+          g += qGreen(c);
+          b += qBlue(c);
+        }
+      pixels[i] = qRgba(r/SAMPLES, g/SAMPLES, b/SAMPLES, a/SAMPLES);
+      samples += SAMPLES;
+    }
+}
+
+#ifdef RASTER_KERNELS_X86
+__attribute__((target("sse4.1")))
+int fillSse41(const EdgeSetup &s, QRgb c, QRgb *row, std::ptrdiff_t pitch)
+{
+  constexpr int N = 4;
+  int written = 0;
+  const int x0 = s.minx & ~(N-1);
+  const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i color = _mm_set1_epi32(c);
+  const __m128i xmin = _mm_set1_epi32(s.minx - 1);
+  const __m128i xmax = _mm_set1_epi32(s.maxx + 1);
+
+  __m128i laneStep[3], chunkStep[3];
+  int rowStart[3];
+  for (int i = 0; i < 3; i++)
+    {
+      laneStep[i] = _mm_mullo_epi32(lane, _mm_set1_epi32(s.stepX[i]));
+      chunkStep[i] = _mm_set1_epi32(N*s.stepX[i]);
+      rowStart[i] = s.e[i] + (x0 - s.minx)*s.stepX[i];
+    }
+
+  for (int y = s.miny; y <= s.maxy; y++)
+    {
+      __m128i e0 = _mm_add_epi32(_mm_set1_epi32(rowStart[0]), laneStep[0]);
+      __m128i e1 = _mm_add_epi32(_mm_set1_epi32(rowStart[1]), laneStep[1]);
+      __m128i e2 = _mm_add_epi32(_mm_set1_epi32(rowStart[2]), laneStep[2]);
+      __m128i xs = _mm_add_epi32(_mm_set1_epi32(x0), lane);
+      for (int x = x0; x <= s.maxx; x += N)
+        {
+          __m128i inside = _mm_srai_epi32(_mm_and_si128(_mm_and_si128(e0, e1), e2), 31);
+          __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(xs, xmin), _mm_cmplt_epi32(xs, xmax));
+          __m128i mask = _mm_and_si128(inside, inRange);
+          if (!_mm_testz_si128(mask, mask))
+            {
+              __m128i *dst = reinterpret_cast<__m128i*>(row + x);
+              _mm_store_si128(dst, _mm_blendv_epi8(_mm_load_si128(dst), color, mask));
+#ifdef TINYRENDERER_PROFILING
+              written += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+#endif
+            }
+          e0 = _mm_add_epi32(e0, chunkStep[0]);
+          e1 = _mm_add_epi32(e1, chunkStep[1]);
+          e2 = _mm_add_epi32(e2, chunkStep[2]);
+          xs = _mm_add_epi32(xs, _mm_set1_epi32(N));
+        }
+      for (int i = 0; i < 3; i++)
+        {
+          rowStart[i] += s.stepY[i];
+        }
+      row += pitch;
+    }
+  return written;
+}
+
+__attribute__((target("avx2")))
+int fillAvx2(const EdgeSetup &s, QRgb c, QRgb *row, std::ptrdiff_t pitch)
+{
+  constexpr int N = 8;
+  int written = 0;
+  const int x0 = s.minx & ~(N-1);
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i color = _mm256_set1_epi32(c);
+  const __m256i xmin = _mm256_set1_epi32(s.minx - 1);
+  const __m256i xmax = _mm256_set1_epi32(s.maxx + 1);
+
+  __m256i laneStep[3], chunkStep[3];
+  int rowStart[3];
+  for (int i = 0; i < 3; i++)
+    {
+      laneStep[i] = _mm256_mullo_epi32(lane, _mm256_set1_epi32(s.stepX[i]));
+      chunkStep[i] = _mm256_set1_epi32(N*s.stepX[i]);
+      rowStart[i] = s.e[i] + (x0 - s.minx)*s.stepX[i];
+    }
+
+  for (int y = s.miny; y <= s.maxy; y++)
+    {
+      __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[0]), laneStep[0]);
+      __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[1]), laneStep[1]);
+      __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[2]), laneStep[2]);
+      __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x0), lane);
+      for (int x = x0; x <= s.maxx; x += N)
+        {
+          __m256i inside = _mm256_srai_epi32(_mm256_and_si256(_mm256_and_si256(e0, e1), e2), 31);
+          __m256i inRange = _mm256_and_si256(_mm256_cmpgt_epi32(xs, xmin), _mm256_cmpgt_epi32(xmax, xs));
+          __m256i mask = _mm256_and_si256(inside, inRange);
+          if (!_mm256_testz_si256(mask, mask))
+            {
+              _mm256_maskstore_epi32(reinterpret_cast<int*>(row + x), mask, color);
+#ifdef TINYRENDERER_PROFILING
+              written += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+#endif
+            }
+          e0 = _mm256_add_epi32(e0, chunkStep[0]);
+          e1 = _mm256_add_epi32(e1, chunkStep[1]);
+          e2 = _mm256_add_epi32(e2, chunkStep[2]);
+          xs = _mm256_add_epi32(xs, _mm256_set1_epi32(N));
+        }
+      for (int i = 0; i < 3; i++)
+        {
+          rowStart[i] += s.stepY[i];
+        }
+      row += pitch;
+    }
+  return written;
+}
+
+// Depth values of 8 pixels in the lanes of a vector, encoded exactly like DepthTraits does:
+// 32-bit integers for the unorm formats, floats for the others. Masks have all bits set in the
+// lanes that are true.
+template <typename T, int MAX>
+struct UnormLanes
+{
+  // std::round rounds halfway cases away from zero, the rounding instructions don't have that
+  // mode. The fractional part is exact in float, so this gives the same integers.
+  __attribute__((target("avx2")))
+  static __m256i encode(__m256 z)
+  {
+    __m256 x = _mm256_mul_ps(z, _mm256_set1_ps(MAX));
+    __m256 whole = _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256 up = _mm256_cmp_ps(_mm256_sub_ps(x, whole), _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+    __m256i rounded = _mm256_cvttps_epi32(_mm256_add_ps(whole, _mm256_and_ps(up, _mm256_set1_ps(1.0f))));
+    return _mm256_min_epi32(_mm256_max_epi32(rounded, _mm256_setzero_si256()), _mm256_set1_epi32(MAX));
+  }
+  __attribute__((target("avx2")))
+  static __m256i load(const T *p)
+  {
+    if constexpr (sizeof(T) == 1)
+      {
+        return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+      }
+    else
+      {
+        return _mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(p)));
+      }
+  }
+  __attribute__((target("avx2")))
+  static __m256i nearer(__m256i a, __m256i b)
+  {
+    return _mm256_cmpgt_epi32(a, b);
+  }
+  // Writes value where mask is set and old everywhere else.
+  __attribute__((target("avx2")))
+  static void store(T *p, __m256i old, __m256i value, __m256i mask)
+  {
+    __m256i v = _mm256_blendv_epi8(old, value, mask);
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    if constexpr (sizeof(T) == 1)
+      {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(packed, packed));
+      }
+    else
+      {
+        _mm_store_si128(reinterpret_cast<__m128i*>(p), packed);
+      }
+  }
+};
+
+template <bool REVERSED>
+struct FloatLanes
+{
+  // max and min return their second operand when the comparison fails, which makes them
+  // std::clamp.
+  __attribute__((target("avx2")))
+  static __m256 encode(__m256 z)
+  {
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 clamped = _mm256_min_ps(one, _mm256_max_ps(_mm256_setzero_ps(), z));
+    return REVERSED ? clamped : _mm256_sub_ps(one, clamped);
+  }
+  __attribute__((target("avx2")))
+  static __m256 load(const float *p)
+  {
+    return _mm256_load_ps(p);
+  }
+  __attribute__((target("avx2")))
+  static __m256i nearer(__m256 a, __m256 b)
+  {
+    return _mm256_castps_si256(REVERSED ? _mm256_cmp_ps(a, b, _CMP_GT_OQ) : _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+  __attribute__((target("avx2")))
+  static void store(float *p, __m256, __m256 value, __m256i mask)
+  {
+    _mm256_maskstore_ps(p, mask, value);
+  }
+};
+
+template <DepthFormat F> struct DepthLanes;
+template <> struct DepthLanes<DepthFormat::Unorm8> : UnormLanes<quint8, 255> {};
+template <> struct DepthLanes<DepthFormat::Unorm16> : UnormLanes<quint16, 65535> {};
+template <> struct DepthLanes<DepthFormat::Float32> : FloatLanes<false> {};
+template <> struct DepthLanes<DepthFormat::Float32Reversed> : FloatLanes<true> {};
+
+// fillAvx2's walk, with the depth of each group computed, tested and written in the lanes.
+template <DepthFormat F>
+__attribute__((target("avx2")))
+DepthCounts depthAvx2(const DepthSetup &s, void *depth, std::ptrdiff_t pitch)
+{
+  using Lanes = DepthLanes<F>;
+  using Type = typename DepthTraits<F>::Type;
+  constexpr int N = 8;
+  const EdgeSetup &edges = s.edges;
+  Type *row = static_cast<Type*>(depth);
+  DepthCounts counts = {0, 0};
+  const int x0 = edges.minx & ~(N-1);
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i origin = _mm256_set1_epi32(s.x0);
+  const __m256i xmin = _mm256_set1_epi32(edges.minx - 1);
+  const __m256i xmax = _mm256_set1_epi32(edges.maxx + 1);
+  const __m256 zStepX = _mm256_set1_ps(s.stepX);
+
+  __m256i laneStep[3], chunkStep[3];
+  int rowStart[3];
+  for (int i = 0; i < 3; i++)
+    {
+      laneStep[i] = _mm256_mullo_epi32(lane, _mm256_set1_epi32(edges.stepX[i]));
+      chunkStep[i] = _mm256_set1_epi32(N*edges.stepX[i]);
+      rowStart[i] = edges.e[i] + (x0 - edges.minx)*edges.stepX[i];
+    }
+
+  for (int y = edges.miny; y <= edges.maxy; y++)
+    {
+      __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[0]), laneStep[0]);
+      __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[1]), laneStep[1]);
+      __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(rowStart[2]), laneStep[2]);
+      __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x0), lane);
+      const __m256 rowZ = _mm256_set1_ps(s.z + (y - s.y0)*s.stepY);
+      for (int x = x0; x <= edges.maxx; x += N)
+        {
+          __m256i inside = _mm256_srai_epi32(_mm256_and_si256(_mm256_and_si256(e0, e1), e2), 31);
+          __m256i inRange = _mm256_and_si256(_mm256_cmpgt_epi32(xs, xmin), _mm256_cmpgt_epi32(xmax, xs));
+          __m256i mask = _mm256_and_si256(inside, inRange);
+          if (!_mm256_testz_si256(mask, mask))
+            {
+              __m256 dx = _mm256_cvtepi32_ps(_mm256_sub_epi32(xs, origin));
+              auto incoming = Lanes::encode(_mm256_add_ps(rowZ, _mm256_mul_ps(dx, zStepX)));
+              auto stored = Lanes::load(row + x);
+              __m256i passes = _mm256_andnot_si256(Lanes::nearer(stored, incoming), mask);
+              if (!_mm256_testz_si256(passes, passes))
+                {
+                  Lanes::store(row + x, stored, incoming, passes);
+                }
+              counts.tested += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+              counts.written += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(passes)));
+            }
+          e0 = _mm256_add_epi32(e0, chunkStep[0]);
+          e1 = _mm256_add_epi32(e1, chunkStep[1]);
+          e2 = _mm256_add_epi32(e2, chunkStep[2]);
+          xs = _mm256_add_epi32(xs, _mm256_set1_epi32(N));
+        }
+      for (int i = 0; i < 3; i++)
+        {
+          rowStart[i] += edges.stepY[i];
+        }
+      row += pitch;
+    }
+  return counts;
+}
+
+// The channels of a pixel's samples are widened to 16 bits and summed, which can't overflow for
+// 8 samples, then rounded and packed back. A pixel per iteration.
+template <int SAMPLES>
+__attribute__((target("sse4.1")))
+void resolveSse41(const QRgb *samples, QRgb *pixels, int count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(SAMPLES/2);
+  constexpr int SHIFT = SAMPLES == 4 ? 2 : 3;
+  for (int i = 0; i < count; i++)
+    {
+      __m128i sum = zero;
+      for (int k = 0; k < SAMPLES; k += 4)
+        {
+          __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + k));
+          sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+        }
+      sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+      sum = _mm_srli_epi16(_mm_add_epi16(sum, half), SHIFT);
+      pixels[i] = QRgb(_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum)));
+      samples += SAMPLES;
+    }
+}
+
+// The same sums, 4 pixels per iteration. With 4 samples, a 128-bit lane holds a pixel, and this
+// leaves its rounded channels in the low 64 bits of the lane.
+__attribute__((target("avx2")))
+inline __m256i average4x(__m256i v)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero));
+  sum = _mm256_add_epi16(sum, _mm256_srli_si256(sum, 8));
+  return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2")))
+void resolve4xAvx2(const QRgb *samples, QRgb *pixels, int count)
+{
+  // The pixels end up in dwords 0 and 4 of the first vector and 2 and 6 of the second.
+  const __m256i order = _mm256_setr_epi32(0, 4, 2, 6, 1, 3, 5, 7);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    {
+      __m256i a = average4x(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + 4*i)));
+      __m256i b = average4x(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + 4*i + 8)));
+      __m256i packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), order);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), _mm256_castsi256_si128(packed));
+    }
+  resolveScalar<4>(samples + 4*i, pixels + i, count - i);
+}
+
+// With 8, a whole vector holds a pixel. The sum of its channels ends up in the low 64 bits.
+__attribute__((target("avx2")))
+inline __m256i sum8x(const QRgb *p)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  __m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero));
+  sum = _mm256_add_epi16(sum, _mm256_srli_si256(sum, 8));
+  return _mm256_add_epi16(sum, _mm256_permute2x128_si256(sum, sum, 1));
+}
+
+__attribute__((target("avx2")))
+void resolve8xAvx2(const QRgb *samples, QRgb *pixels, int count)
+{
+  const __m256i half = _mm256_set1_epi16(4);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    {
+      const QRgb *p = samples + 8*i;
+      __m256i ab = _mm256_unpacklo_epi64(sum8x(p), sum8x(p + 8));
+      __m256i cd = _mm256_unpacklo_epi64(sum8x(p + 16), sum8x(p + 24));
+      ab = _mm256_srli_epi16(_mm256_add_epi16(ab, half), 3);
+      cd = _mm256_srli_epi16(_mm256_add_epi16(cd, half), 3);
+      __m256i packed = _mm256_packus_epi16(ab, cd);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), _mm256_castsi256_si128(packed));
+    }
+  resolveScalar<8>(samples + 8*i, pixels + i, count - i);
+}
+#endif
+}
+
+InstructionSet
+bestInstructionSet()
+{
+#ifdef RASTER_KERNELS_X86
+  static const InstructionSet best = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      {
+        return InstructionSet::AVX2;
+      }
+    if (__builtin_cpu_supports("sse4.1"))
+      {
+        return InstructionSet::SSE41;
+      }
+    return InstructionSet::Scalar;
+  }();
+  return best;
+#else
+  return InstructionSet::Scalar;
+#endif
+}
+
+const char *
+instructionSetName(InstructionSet set)
+{
+  switch (set)
+    {
+    case InstructionSet::AVX2:  return "AVX2";
+    case InstructionSet::SSE41: return "SSE4.1";
+    case InstructionSet::Scalar: break;
+    }
+  return "scalar";
+}
+
+FillFunc
+fillTriangle(InstructionSet set)
+{
+  // Never hand out a kernel the CPU can't run.
+  if (set > bestInstructionSet())
+    {
+      set = bestInstructionSet();
+    }
+#ifdef RASTER_KERNELS_X86
+  if (set == InstructionSet::AVX2)
+    {
+      return fillAvx2;
+    }
+  if (set == InstructionSet::SSE41)
+    {
+      return fillSse41;
+    }
+#endif
+  return fillScalar;
+}
+
+template <DepthFormat F>
+DepthFunc
+depthKernel(InstructionSet set)
+{
+#ifdef RASTER_KERNELS_X86
+  if (set == InstructionSet::AVX2)
+    {
+      return depthAvx2<F>;
+    }
+#endif
+  (void)set;
+  return depthScalar<F>;
+}
+
+DepthFunc
+fillDepth(DepthFormat format, InstructionSet set)
+{
+  if (set > bestInstructionSet())
+    {
+      set = bestInstructionSet();
+    }
+  switch (format)
+    {
+    case DepthFormat::Unorm8:          return depthKernel<DepthFormat::Unorm8>(set);
+    case DepthFormat::Unorm16:         return depthKernel<DepthFormat::Unorm16>(set);
+    case DepthFormat::Float32:         return depthKernel<DepthFormat::Float32>(set);
+    case DepthFormat::Float32Reversed: return depthKernel<DepthFormat::Float32Reversed>(set);
+    }
+  return nullptr;
+}
+
+ResolveFunc
+resolveSamples(int samples, InstructionSet set)
+{
+  if (set > bestInstructionSet())
+    {
+      set = bestInstructionSet();
+    }
+#ifdef RASTER_KERNELS_X86
+  if (set == InstructionSet::AVX2)
+    {
+      return samples == 8 ? resolve8xAvx2 : resolve4xAvx2;
+    }
+  if (set == InstructionSet::SSE41)
+    {
+      return samples == 8 ? resolveSse41<8> : resolveSse41<4>;
+    }
+#endif
+  return samples == 8 ? resolveScalar<8> : resolveScalar<4>;
+}
+}
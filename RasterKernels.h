@@ -0,0 +1,78 @@
+#pragma once
+
+#include "DepthFormat.h"
+
+#include <QImage>
+#include <cstddef>
+
+// Inner loops of the vectorized rasterizers. FrameBuffer does the triangle setup and hands the
+// per-row work to one of these; the instruction set is picked once at runtime.
+namespace RasterKernels
+{
+enum class InstructionSet
+{
+  Scalar,
+  SSE41,
+  AVX2,
+};
+
+// Edge functions of a triangle, already biased by the top-left fill rule so that a pixel is
+// covered when all three values are negative.
+struct EdgeSetup
+{
+  int minx, maxx, miny, maxy; // clipped bounding box
+  int e[3];                   // edge values at (minx, miny)
+  int stepX[3];               // increment for one pixel to the right
+  int stepY[3];               // increment for one row up
+};
+
+// Fills every covered pixel in the bounding box. row points at the pixel (0, miny) and pitch is
+// the distance in pixels from one row to the row above. Returns the number of pixels written; the
+// vector paths only count them when TINYRENDERER_PROFILING is defined, and return 0 otherwise.
+//
+// The vector paths process 4 or 8 pixels starting at multiples of 4 or 8. The SSE path writes
+// back (unchanged) pixels next to the bounding box within such a group, so concurrent callers
+// must use clip rectangles aligned to 8 pixels horizontally, and rows must be padded to 8 pixels.
+using FillFunc = int (*)(const EdgeSetup &setup, QRgb c, QRgb *row, std::ptrdiff_t pitch);
+
+// A depth plane over the bounding box of an EdgeSetup. Pixel (x, y) gets
+//   (z + (y - y0)*stepY) + (x - x0)*stepX
+// in float, the same expression as RasterPipeline::Plane, so the depth written here compares
+// equal to what the pipeline computes for the same pixel. That holds as long as neither side
+// fuses the multiply and the add, which the build turns off (see CMakeLists.txt).
+struct DepthSetup
+{
+  EdgeSetup edges;
+  float z, stepX, stepY;
+  int x0, y0; // origin of the plane
+};
+
+struct DepthCounts
+{
+  int tested;  // covered pixels
+  int written; // covered pixels that passed the depth test
+};
+
+// Tests and writes the depth of every covered pixel, in the depth format the function was
+// picked for, and touches nothing else. row points at the depth of pixel (0, miny) and pitch is
+// the distance in depth values from one row to the row above. The counts are exact on every
+// path.
+//
+// The vector path processes 8 pixels starting at multiples of 8 and writes back (unchanged)
+// depth next to the bounding box within such a group, with the same requirements as the SSE
+// fill above. There is no SSE4.1 path, that set gets the scalar one.
+using DepthFunc = DepthCounts (*)(const DepthSetup &setup, void *row, std::ptrdiff_t pitch);
+
+// Averages the samples of count pixels: samples holds the colors of every sample of the first
+// pixel, then of the second, and so on. Every channel is rounded to nearest, the same on every
+// path.
+using ResolveFunc = void (*)(const QRgb *samples, QRgb *pixels, int count);
+
+// InstructionSet values are ordered, every set implies the ones before it.
+InstructionSet bestInstructionSet();
+const char *instructionSetName(InstructionSet set);
+FillFunc fillTriangle(InstructionSet set = bestInstructionSet());
+DepthFunc fillDepth(DepthFormat format, InstructionSet set = bestInstructionSet());
+// For 4 or 8 samples per pixel.
+ResolveFunc resolveSamples(int samples, InstructionSet set = bestInstructionSet());
+}
@@ -0,0 +1,684 @@
+#pragma once
+
+#include "DepthFormat.h"
+#include "FrameBuffer.h"
+#include "Profiler.h"
+#include "RasterKernels.h"
+#include "Shader.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+// The sub-pixel edge-function rasterizer as one kernel template, specialized at compile time for
+// every combination of the options below and for the fragment shader (see Shader.h). A State
+// describes a draw, select() turns it into the matching specialization once, and the kernel has
+// no run-time branches on any option.
+//
+// New modes go here: an enumerator, its case in the kernel (rasterize(), below) and a line in
+// select(). The kernel is in this header so that it can be instantiated for any shader.
+namespace RasterPipeline
+{
+enum class Cull
+{
+  None, // back faces are drawn with their winding flipped
+  Back,
+};
+
+enum class Depth
+{
+  Off,
+  TestWrite, // test against the depth buffer, write what passes
+  // Passes only where the depth is exactly that in the buffer, and writes nothing. The color pass
+  // after a depth-only one: every pixel computes the same depth in both passes.
+  Equal,
+};
+
+enum class Output
+{
+  Color,   // shades every pixel that passes the depth test
+  // Deferred shading: writes the triangle and its barycentrics to the G-buffer, and resolve()
+  // shades every visible pixel once afterwards. One triangle per pixel, whatever the samples.
+  GBuffer,
+  // Depth only, no color and no varyings, for depth prepasses. Always tests and writes depth, and
+  // single-sampled draws go through the vector kernels of RasterKernels.
+  DepthOnly,
+};
+
+struct State
+{
+  Cull cull = Cull::Back;
+  Depth depth = Depth::Off;
+  // 1 (pixel centers), 4 (rotated grid) or 8. Color draws with more than one store every sample's
+  // color and depth in the frame buffer's samples, which have to be enabled with the same count:
+  // coverage and depth are per sample, the shader runs once per pixel, at its center, and
+  // resolving the samples is up to the caller. The other outputs only use the samples for
+  // coverage, depth is at the pixel center.
+  int samples = 1;
+  Output output = Output::Color;
+  // With Depth::TestWrite and 1 sample: the tile binner draws every tile twice, depth only and
+  // then with Depth::Equal, so that every pixel is shaded once. select() ignores it.
+  bool depthPrepass = false;
+};
+
+// The options as template arguments. The depth format of the target buffer is one too.
+template <Cull C, Depth D, int Samples, Output O, DepthFormat F>
+struct Policy
+{
+  static constexpr Cull cull = C;
+  static constexpr Depth depth = D;
+  static constexpr int samples = Samples;
+  static constexpr Output output = O;
+  static constexpr DepthFormat depthFormat = F;
+};
+
+struct Triangle
+{
+  vertex p, q, r;
+  QRgb c;        // flat color, for FragmentInput
+  uint32_t v[3]; // entries of the varyings at p, q and r
+};
+
+// A draw's triangles, and its varyings with the fragment shader its BinFunc was selected for.
+struct DrawData
+{
+  const Triangle *triangles;
+  const float *varyings; // FragmentShader::VARYINGS floats per entry
+  const void *fragmentShader;
+};
+
+// Draws the triangles of indices, in order, clipped to clip.
+using BinFunc = void (*)(FrameBuffer &fb, const DrawData &draw, const uint32_t *indices,
+                         size_t count, const rect &clip);
+using SelectFunc = BinFunc (*)(const State &state, DepthFormat depthFormat);
+// Shades the pixels of clip that an Output::GBuffer draw left a triangle in.
+using ResolveFunc = void (*)(FrameBuffer &fb, const DrawData &draw, const rect &clip);
+
+// The specialization for state and FragmentShader, drawing into buffers of the given depth
+// format.
+template <typename FragmentShader>
+BinFunc select(const State &state, DepthFormat depthFormat);
+
+// Runs FragmentShader once on every pixel of clip that holds a triangle in the G-buffer, and
+// clears the G-buffer there. The pixels are independent, and every one costs the same whatever
+// the depth complexity of the scene.
+template <typename FragmentShader>
+void resolve(FrameBuffer &fb, const DrawData &draw, const rect &clip);
+
+// A fragment shader with its type erased, for the tile binner.
+struct FragmentStage
+{
+  SelectFunc select;
+  ResolveFunc resolve;
+  const void *shader; // has to outlive the draw
+
+  template <typename FragmentShader>
+  static FragmentStage of(const FragmentShader &shader)
+  {
+    return {&RasterPipeline::select<FragmentShader>, &RasterPipeline::resolve<FragmentShader>, &shader};
+  }
+};
+
+inline constexpr FlatShader flatShader{};
+
+// Draws triangle index of the draw.
+template <typename Policy, typename FragmentShader>
+void rasterize(FrameBuffer &fb, const DrawData &draw, uint32_t index, const FragmentShader &shader,
+               const rect &clip);
+
+// Edge functions of a triangle with 28.4 vertices, evaluated at pixel centers. The values are in
+// 1/256ths of a square pixel and need 64 bits for vertices far off-screen. The layout matches
+// triangle5: edge i goes from vertex i to vertex i+1, and a point is inside when every edge
+// function is negative, or zero on a top-left edge.
+struct FixedEdges
+{
+  int minx, maxx, miny, maxy; // clipped bounding box, in pixels
+  int64_t e[3];               // at the center of pixel (minx, miny), biased by the fill rule
+  int64_t stepX[3];           // one pixel to the right
+  int64_t stepY[3];           // one row up
+  int64_t dx[3], dy[3];       // edge vectors, for sample offsets
+  int x0, y0;                 // origin of the planes, independent of the clip rectangle
+  int64_t e0[3];              // unbiased edge functions at the origin
+  double invArea;             // -1/area2
+};
+
+// A value interpolated linearly across a triangle, from the origin of its FixedEdges. Pixel
+// (x, y) gets rowStart(edges, y) + (x - edges.x0)*stepX.
+struct Plane
+{
+  float value, stepX, stepY;
+
+  float rowStart(const FixedEdges &edges, int y) const
+  {
+    return value + (y - edges.y0)*stepY;
+  }
+};
+
+inline bool edgeIsTopLeft(const vertex &a, const vertex &b)
+{
+  return ((a.y == b.y) && (b.x < a.x)) || (a.y < b.y);
+}
+
+inline bool isBackFacing(const vertex &p, const vertex &q, const vertex &r)
+{
+  return (r.x - int64_t(p.x))*(q.y - int64_t(p.y)) - (r.y - int64_t(p.y))*(q.x - int64_t(p.x)) > 0;
+}
+
+// Returns false when the triangle is back-facing, degenerate, or outside clip. margin widens the
+// bounding box (in 1/16 pixel) for sample positions away from the pixel center.
+inline bool setupFixedEdges(const vertex &p, const vertex &q, const vertex &r, const rect &clip,
+                            int margin, FixedEdges &edges)
+{
+  const vertex *start[3] = {&p, &q, &r};
+  const vertex *end[3]   = {&q, &r, &p};
+  for (int i = 0; i < 3; i++)
+    {
+      edges.dx[i] = int64_t(end[i]->x) - start[i]->x;
+      edges.dy[i] = int64_t(end[i]->y) - start[i]->y;
+    }
+
+  // Twice the area, in the same units as the edge functions. Back faces and degenerate triangles
+  // are culled.
+  int64_t area2 = -((r.x - int64_t(p.x))*edges.dy[0] - (r.y - int64_t(p.y))*edges.dx[0]);
+  if (area2 <= 0)
+    {
+      return false;
+    }
+
+  // Pixel centers covered by the bounding box: ceil(min/16) to floor(max/16), clamped to clip.
+  int minX = std::min(std::min(p.x, q.x), r.x) - margin;
+  int maxX = std::max(std::max(p.x, q.x), r.x) + margin;
+  int minY = std::min(std::min(p.y, q.y), r.y) - margin;
+  int maxY = std::max(std::max(p.y, q.y), r.y) + margin;
+  edges.minx = std::max((minX + SUBPIXEL_ONE-1) >> SUBPIXEL_BITS, clip.minx);
+  edges.maxx = std::min(maxX >> SUBPIXEL_BITS, clip.maxx);
+  edges.miny = std::max((minY + SUBPIXEL_ONE-1) >> SUBPIXEL_BITS, clip.miny);
+  edges.maxy = std::min(maxY >> SUBPIXEL_BITS, clip.maxy);
+  if (edges.minx > edges.maxx || edges.miny > edges.maxy)
+    {
+      return false;
+    }
+
+  auto edgeAt = [&](int i, int x, int y) {
+    return ((int64_t(x) << SUBPIXEL_BITS) - start[i]->x)*edges.dy[i]
+         - ((int64_t(y) << SUBPIXEL_BITS) - start[i]->y)*edges.dx[i];
+  };
+  for (int i = 0; i < 3; i++)
+    {
+      edges.e[i] = edgeAt(i, edges.minx, edges.miny) - (edgeIsTopLeft(*start[i], *end[i]) ? 1 : 0);
+      edges.stepX[i] = edges.dy[i]*SUBPIXEL_ONE;
+      edges.stepY[i] = -edges.dx[i]*SUBPIXEL_ONE;
+    }
+
+  // The planes are anchored at the unclipped bounding box and evaluated from there at every pixel,
+  // never from the clipped one, so a pixel gets the same values whichever tile it is rasterized
+  // in.
+  edges.x0 = (minX + SUBPIXEL_ONE-1) >> SUBPIXEL_BITS;
+  edges.y0 = (minY + SUBPIXEL_ONE-1) >> SUBPIXEL_BITS;
+  for (int i = 0; i < 3; i++)
+    {
+      edges.e0[i] = edgeAt(i, edges.x0, edges.y0);
+    }
+  edges.invArea = -1.0/area2;
+  return true;
+}
+
+// The barycentric weight of a vertex is the edge function of the opposite edge over -area2, so
+// any value given at the vertices is a plane in the edge functions. There is no per-pixel
+// division.
+inline Plane fixedPlane(const FixedEdges &edges, float atP, float atQ, float atR)
+{
+  const float atEdge[3] = {atR, atP, atQ}; // the vertex opposite each edge
+  double v = 0, vx = 0, vy = 0;
+  for (int i = 0; i < 3; i++)
+    {
+      v  += edges.e0[i]*edges.invArea*atEdge[i];
+      vx += edges.stepX[i]*edges.invArea*atEdge[i];
+      vy += edges.stepY[i]*edges.invArea*atEdge[i];
+    }
+  return {float(v), float(vx), float(vy)};
+}
+
+// Sample offsets from the pixel center, in 1/16 pixel: 4 samples on a rotated grid, and the
+// usual 8 sample pattern of GPUs with y pointing up.
+constexpr int sampleOffsets4x[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+constexpr int sampleOffsets8x[8][2] = {{1, 3}, {-1, -3}, {5, -1}, {-3, 5}, {-5, -5}, {-7, 1}, {3, -7}, {7, 7}};
+
+template <int SAMPLES>
+constexpr const int (&sampleOffsets())[SAMPLES][2]
+{
+  if constexpr (SAMPLES == 4)
+    {
+      return sampleOffsets4x;
+    }
+  else
+    {
+      return sampleOffsets8x;
+    }
+}
+
+// What is left to do once a triangle is drawn: keep the Hi-Z bounds valid, and count.
+template <typename Policy>
+void finishTriangle(FrameBuffer &fb, const FixedEdges &edges, float nearestZ, quint64 tested, quint64 written)
+{
+  if constexpr (Policy::depth == Depth::TestWrite)
+    {
+      fb.depthWritten({edges.minx, edges.miny, edges.maxx, edges.maxy}, nearestZ);
+    }
+  PROFILE_COUNT(TrianglesRasterized, 1);
+  PROFILE_COUNT(PixelsTested, tested);
+  PROFILE_COUNT(PixelsWritten, written);
+  PROFILE_COUNT(PixelsShaded, Policy::output == Output::Color ? written : 0);
+}
+
+// A single-sampled depth-only triangle through RasterKernels::fillDepth(). The kernels have 32-bit
+// edge functions; when those overflow anywhere the kernels step (the groups of 8 pixels around
+// the box, and one row above it), this returns false without drawing and the scalar loop of
+// rasterize() takes the triangle.
+template <DepthFormat F>
+bool fillDepthOnly(FrameBuffer &fb, const FixedEdges &edges, const Plane &z, RasterKernels::DepthCounts &counts)
+{
+  auto fits = [](int64_t v) {
+    return std::numeric_limits<int32_t>::min() <= v && v <= std::numeric_limits<int32_t>::max();
+  };
+  const int xs[2] = {edges.minx & ~7, (edges.maxx | 7) + 1};
+  const int ys[2] = {edges.miny, edges.maxy + 1};
+  RasterKernels::DepthSetup setup;
+  for (int i = 0; i < 3; i++)
+    {
+      if (!fits(8*edges.stepX[i]) || !fits(edges.stepY[i]))
+        {
+          return false;
+        }
+      for (int x : xs)
+        {
+          for (int y : ys)
+            {
+              if (!fits(edges.e[i] + (x - edges.minx)*edges.stepX[i] + (y - edges.miny)*edges.stepY[i]))
+                {
+                  return false;
+                }
+            }
+        }
+      setup.edges.e[i] = int(edges.e[i]);
+      setup.edges.stepX[i] = int(edges.stepX[i]);
+      setup.edges.stepY[i] = int(edges.stepY[i]);
+    }
+  setup.edges.minx = edges.minx;
+  setup.edges.maxx = edges.maxx;
+  setup.edges.miny = edges.miny;
+  setup.edges.maxy = edges.maxy;
+  setup.z = z.value;
+  setup.stepX = z.stepX;
+  setup.stepY = z.stepY;
+  setup.x0 = edges.x0;
+  setup.y0 = edges.y0;
+
+  static const RasterKernels::DepthFunc fill = RasterKernels::fillDepth(F);
+  counts = fill(setup, fb.depthRow<typename DepthTraits<F>::Type>(edges.miny), fb.depthRowStep());
+  return true;
+}
+
+// Every option of the policy and the shader are compile-time constants, so each specialization
+// only has the per-pixel work its options need.
+template <typename Policy, typename FragmentShader>
+void
+rasterize(FrameBuffer &fb, const DrawData &draw, uint32_t index, const FragmentShader &shader,
+          const rect &clip)
+{
+  using Traits = DepthTraits<Policy::depthFormat>;
+  using DepthType = typename Traits::Type;
+  constexpr int SAMPLES = Policy::samples;
+  constexpr bool SHADED = Policy::output == Output::Color;
+  constexpr bool GBUFFER = Policy::output == Output::GBuffer;
+  // Color and depth per sample, in the frame buffer's samples.
+  constexpr bool MULTISAMPLED = SHADED && SAMPLES > 1;
+  constexpr int VARYINGS = SHADED ? FragmentShader::VARYINGS : 0;
+  static_assert(SAMPLES == 1 || SAMPLES == 4 || SAMPLES == 8);
+  static_assert(Policy::output != Output::DepthOnly || Policy::depth == Depth::TestWrite);
+
+  const Triangle &t = draw.triangles[index];
+  const float *varyings = draw.varyings;
+  vertex p = t.p, q = t.q, r = t.r;
+  uint32_t vp = t.v[0], vq = t.v[1], vr = t.v[2];
+  bool swapped = false;
+  if constexpr (Policy::cull == Cull::None)
+    {
+      if (isBackFacing(p, q, r))
+        {
+          std::swap(q, r);
+          std::swap(vq, vr);
+          swapped = true;
+        }
+    }
+
+  FixedEdges edges;
+  if (!setupFixedEdges(p, q, r, clip, SAMPLES == 8 ? 7 : SAMPLES == 4 ? 6 : 0, edges))
+    {
+      return;
+    }
+
+  // Depth is interpolated for the shader too. Whatever neither uses is dropped by the compiler.
+  Plane z = fixedPlane(edges, p.z, q.z, r.z);
+
+  // Edge function and depth offsets of the samples from the pixel center.
+  int64_t sampleE[SAMPLES][3];
+  float sampleZ[SAMPLES];
+  if constexpr (SAMPLES > 1)
+    {
+      for (int s = 0; s < SAMPLES; s++)
+        {
+          const int *offset = sampleOffsets<SAMPLES>()[s];
+          for (int i = 0; i < 3; i++)
+            {
+              sampleE[s][i] = offset[0]*edges.dy[i] - offset[1]*edges.dx[i];
+            }
+          sampleZ[s] = (offset[0]*z.stepX + offset[1]*z.stepY)/SUBPIXEL_ONE;
+        }
+    }
+  float nearestZ = std::max(std::max(p.z, q.z), r.z);
+  if constexpr (Policy::output == Output::DepthOnly && SAMPLES == 1)
+    {
+      RasterKernels::DepthCounts counts;
+      if (fillDepthOnly<Policy::depthFormat>(fb, edges, z, counts))
+        {
+          finishTriangle<Policy>(fb, edges, nearestZ, counts.tested, counts.written);
+          return;
+        }
+    }
+  std::array<Plane, VARYINGS> planes;
+  for (int k = 0; k < VARYINGS; k++)
+    {
+      planes[k] = fixedPlane(edges, varyings[size_t(vp)*VARYINGS + k], varyings[size_t(vq)*VARYINGS + k],
+                             varyings[size_t(vr)*VARYINGS + k]);
+    }
+  // The G-buffer gets the weights of the triangle's own q and r, whatever the winding.
+  Plane weightQ{}, weightR{};
+  if constexpr (GBUFFER)
+    {
+      weightQ = fixedPlane(edges, 0, 1, 0);
+      weightR = fixedPlane(edges, 0, 0, 1);
+      if (swapped)
+        {
+          std::swap(weightQ, weightR);
+        }
+    }
+
+  quint64 tested = 0, written = 0;
+  int64_t rowE0 = edges.e[0], rowE1 = edges.e[1], rowE2 = edges.e[2];
+  for (int y = edges.miny; y <= edges.maxy; y++)
+    {
+      QRgb *colorScanLine = fb.colorRow(y);
+      GBufferTexel *gbufferScanLine = nullptr;
+      if constexpr (GBUFFER)
+        {
+          gbufferScanLine = fb.gbufferRow(y);
+        }
+      DepthType *depthScanLine = nullptr;
+      if constexpr (Policy::depth != Depth::Off)
+        {
+          depthScanLine = fb.depthRow<DepthType>(y);
+        }
+      QRgb *sampleColorScanLine = nullptr;
+      DepthType *sampleDepthScanLine = nullptr;
+      uint8_t *sampleMaskScanLine = nullptr;
+      if constexpr (MULTISAMPLED)
+        {
+          sampleColorScanLine = fb.sampleColorRow(y);
+          sampleDepthScanLine = fb.sampleDepthRow<DepthType>(y);
+          sampleMaskScanLine = fb.sampleMaskRow(y);
+        }
+      int64_t e0 = rowE0, e1 = rowE1, e2 = rowE2;
+      float rowZ = z.rowStart(edges, y);
+      std::array<float, VARYINGS> rowVaryings;
+      for (int k = 0; k < VARYINGS; k++)
+        {
+          rowVaryings[k] = planes[k].rowStart(edges, y);
+        }
+      float rowQ = weightQ.rowStart(edges, y), rowR = weightR.rowStart(edges, y);
+      for (int x = edges.minx; x <= edges.maxx; x++)
+        {
+          // Bit s for sample s, in one pass over the edge functions.
+          unsigned covered = 0;
+          if constexpr (SAMPLES == 1)
+            {
+              covered = (e0 & e1 & e2) < 0;
+            }
+          else
+            {
+              for (int s = 0; s < SAMPLES; s++)
+                {
+                  covered |= unsigned(((e0 + sampleE[s][0]) & (e1 + sampleE[s][1]) & (e2 + sampleE[s][2])) < 0) << s;
+                }
+            }
+          if (covered != 0)
+            {
+              tested++;
+              int dx = x - edges.x0;
+              float pixelZ = rowZ + dx*z.stepX;
+              bool passes = true;
+              DepthType depth{};
+              unsigned passing = covered;
+              if constexpr (MULTISAMPLED)
+                {
+                  // Samples without a value of their own have the pixel's depth.
+                  if constexpr (Policy::depth != Depth::Off)
+                    {
+                      unsigned stored = sampleMaskScanLine[x];
+                      DepthType *sampleDepths = sampleDepthScanLine + x*SAMPLES;
+                      passing = 0;
+                      for (int s = 0; s < SAMPLES; s++)
+                        {
+                          if ((covered & (1u << s)) == 0)
+                            {
+                              continue;
+                            }
+                          DepthType sampleDepth = Traits::encode(pixelZ + sampleZ[s]);
+                          DepthType old = (stored & (1u << s)) ? sampleDepths[s] : depthScanLine[x];
+                          bool samplePasses = Policy::depth == Depth::Equal ? sampleDepth == old
+                                                                             : depthPasses<Policy::depthFormat>(sampleDepth, old);
+                          if (samplePasses)
+                            {
+                              passing |= 1u << s;
+                              if constexpr (Policy::depth == Depth::TestWrite)
+                                {
+                                  sampleDepths[s] = sampleDepth;
+                                }
+                            }
+                        }
+                    }
+                  passes = passing != 0;
+                }
+              else if constexpr (Policy::depth != Depth::Off)
+                {
+                  depth = Traits::encode(pixelZ);
+                  if constexpr (Policy::depth == Depth::Equal)
+                    {
+                      passes = depth == depthScanLine[x];
+                    }
+                  else
+                    {
+                      passes = depthPasses<Policy::depthFormat>(depth, depthScanLine[x]);
+                    }
+                }
+              if (passes)
+                {
+                  if constexpr (SHADED)
+                    {
+                      std::array<float, VARYINGS> v;
+                      for (int k = 0; k < VARYINGS; k++)
+                        {
+                          v[k] = rowVaryings[k] + dx*planes[k].stepX;
+                        }
+                      QRgb src = shader(FragmentInput{x, y, pixelZ, t.c}, v.data());
+                      if constexpr (MULTISAMPLED)
+                        {
+                          if constexpr (Policy::depth != Depth::TestWrite)
+                            {
+                              fb.copyDepthToSamples(x, y, passing & ~unsigned(sampleMaskScanLine[x]));
+                            }
+                          QRgb *sampleColors = sampleColorScanLine + x*SAMPLES;
+                          for (int s = 0; s < SAMPLES; s++)
+                            {
+                              if (passing & (1u << s))
+                                {
+                                  sampleColors[s] = src;
+                                }
+                            }
+                          sampleMaskScanLine[x] |= passing;
+                        }
+                      else
+                        {
+                          colorScanLine[x] = src;
+                        }
+                    }
+                  else if constexpr (GBUFFER)
+                    {
+                      auto unorm = [](float w) { return uint16_t(std::clamp(int(w*65535 + 0.5f), 0, 65535)); };
+                      gbufferScanLine[x] = {index, unorm(rowQ + dx*weightQ.stepX), unorm(rowR + dx*weightR.stepX)};
+                    }
+                  if constexpr (Policy::depth == Depth::TestWrite && !MULTISAMPLED)
+                    {
+                      depthScanLine[x] = depth;
+                    }
+                  written++;
+                }
+            }
+          e0 += edges.stepX[0];
+          e1 += edges.stepX[1];
+          e2 += edges.stepX[2];
+        }
+      rowE0 += edges.stepY[0];
+      rowE1 += edges.stepY[1];
+      rowE2 += edges.stepY[2];
+    }
+
+  finishTriangle<Policy>(fb, edges, nearestZ, tested, written);
+}
+
+template <typename Policy, typename FragmentShader>
+void rasterizeBin(FrameBuffer &fb, const DrawData &draw, const uint32_t *indices, size_t count,
+                  const rect &clip)
+{
+  const FragmentShader &shader = *static_cast<const FragmentShader*>(draw.fragmentShader);
+  for (size_t i = 0; i < count; i++)
+    {
+      rasterize<Policy>(fb, draw, indices[i], shader, clip);
+    }
+}
+
+template <typename FragmentShader>
+void
+resolve(FrameBuffer &fb, const DrawData &draw, const rect &clip)
+{
+  const FragmentShader &shader = *static_cast<const FragmentShader*>(draw.fragmentShader);
+  constexpr int VARYINGS = FragmentShader::VARYINGS;
+  quint64 shaded = 0;
+  for (int y = clip.miny; y <= clip.maxy; y++)
+    {
+      GBufferTexel *gbufferScanLine = fb.gbufferRow(y);
+      QRgb *colorScanLine = fb.colorRow(y);
+      for (int x = clip.minx; x <= clip.maxx; x++)
+        {
+          GBufferTexel &texel = gbufferScanLine[x];
+          if (texel.triangle == NO_TRIANGLE)
+            {
+              continue;
+            }
+          const Triangle &t = draw.triangles[texel.triangle];
+          float u = texel.u*(1/65535.0f), v = texel.v*(1/65535.0f), w = 1 - u - v;
+          const float *atP = draw.varyings + size_t(t.v[0])*VARYINGS;
+          const float *atQ = draw.varyings + size_t(t.v[1])*VARYINGS;
+          const float *atR = draw.varyings + size_t(t.v[2])*VARYINGS;
+          std::array<float, VARYINGS> varyings;
+          for (int k = 0; k < VARYINGS; k++)
+            {
+              varyings[k] = w*atP[k] + u*atQ[k] + v*atR[k];
+            }
+          float z = w*t.p.z + u*t.q.z + v*t.r.z;
+          colorScanLine[x] = shader(FragmentInput{x, y, z, t.c}, varyings.data());
+          texel.triangle = NO_TRIANGLE;
+          shaded++;
+        }
+    }
+  PROFILE_COUNT(PixelsShaded, shaded);
+}
+
+// Turns the state into template arguments one option at a time.
+template <typename FS, Cull C, Depth D, int S, Output O>
+BinFunc selectDepthFormat(DepthFormat format)
+{
+  // In the else branch, so that draws without a depth test only instantiate one format.
+  if constexpr (D == Depth::Off)
+    {
+      return &rasterizeBin<Policy<C, D, S, O, DepthFormat::Unorm16>, FS>; // the format is unused
+    }
+  else
+    {
+      switch (format)
+        {
+        case DepthFormat::Unorm8:          return &rasterizeBin<Policy<C, D, S, O, DepthFormat::Unorm8>, FS>;
+        case DepthFormat::Unorm16:         return &rasterizeBin<Policy<C, D, S, O, DepthFormat::Unorm16>, FS>;
+        case DepthFormat::Float32:         return &rasterizeBin<Policy<C, D, S, O, DepthFormat::Float32>, FS>;
+        case DepthFormat::Float32Reversed: return &rasterizeBin<Policy<C, D, S, O, DepthFormat::Float32Reversed>, FS>;
+        }
+      return nullptr;
+    }
+}
+
+// Depth-only draws never run the shader, they share the instantiations of the flat one.
+template <typename FS, Cull C, Depth D, int S>
+BinFunc selectOutput(const State &state, DepthFormat format)
+{
+  if (state.output == Output::GBuffer)
+    {
+      return selectDepthFormat<FS, C, D, S, Output::GBuffer>(format);
+    }
+  if constexpr (D == Depth::TestWrite)
+    {
+      if (state.output == Output::DepthOnly)
+        {
+          return selectDepthFormat<FlatShader, C, D, S, Output::DepthOnly>(format);
+        }
+    }
+  return selectDepthFormat<FS, C, D, S, Output::Color>(format);
+}
+
+template <typename FS, Cull C, Depth D>
+BinFunc selectSamples(const State &state, DepthFormat format)
+{
+  switch (state.samples)
+    {
+    case 4: return selectOutput<FS, C, D, 4>(state, format);
+    case 8: return selectOutput<FS, C, D, 8>(state, format);
+    }
+  return selectOutput<FS, C, D, 1>(state, format);
+}
+
+template <typename FS, Cull C>
+BinFunc selectDepth(const State &state, DepthFormat format)
+{
+  if (state.output == Output::DepthOnly)
+    {
+      return selectSamples<FS, C, Depth::TestWrite>(state, format);
+    }
+  switch (state.depth)
+    {
+    case Depth::Off:       break;
+    case Depth::TestWrite: return selectSamples<FS, C, Depth::TestWrite>(state, format);
+    case Depth::Equal:     return selectSamples<FS, C, Depth::Equal>(state, format);
+    }
+  return selectSamples<FS, C, Depth::Off>(state, format);
+}
+
+template <typename FragmentShader>
+BinFunc
+select(const State &state, DepthFormat depthFormat)
+{
+  return state.cull == Cull::None ? selectDepth<FragmentShader, Cull::None>(state, depthFormat)
+                                  : selectDepth<FragmentShader, Cull::Back>(state, depthFormat);
+}
+}
@@ -0,0 +1,210 @@
+#include "RenderThread.h"
+
+#include <QMutexLocker>
+#include <utility>
+
+constexpr QRgb white   = qRgba(255, 255, 255, 255);
+constexpr QRgb green   = qRgba(  0, 255, 0, 255);
+constexpr QRgb red     = qRgba(255,   0,   0, 255);
+constexpr QRgb blue    = qRgba( 64, 128, 255, 255);
+constexpr QRgb purple  = qRgba(128, 128, 255, 255);
+constexpr QRgb orange  = qRgba(0xff, 0x5c, 0, 255);
+constexpr QRgb magenta = qRgba(255,   0, 255, 255);
+constexpr QRgb cyan    = qRgba(  0, 255, 255, 255);
+constexpr QRgb yellow  = qRgba(255, 200,   0, 255);
+
+RenderThread::RenderThread (int width, int height, std::optional<Model> model, QObject *parent)
+    : QThread(parent), model(std::move(model)), renderer(width, height),
+      frames{{width, height}, {width, height}, {width, height}}
+{
+  for (RenderedFrame &frame : frames)
+    {
+      frame.fb.clear(QColor(0,0,0,0));
+      frame.fb.clearDepthBuffer();
+      frame.depthMap = frame.fb.depthMap();
+    }
+}
+
+RenderThread::~RenderThread ()
+{
+  stop();
+  wait();
+}
+
+void
+RenderThread::post (const RenderState &state)
+{
+  QMutexLocker locker(&mutex);
+  pendingState = state;
+  statePending = true;
+  wake.wakeOne();
+}
+
+void
+RenderThread::stop ()
+{
+  QMutexLocker locker(&mutex);
+  stopping = true;
+  wake.wakeOne();
+}
+
+const RenderedFrame &
+RenderThread::latestFrame ()
+{
+  QMutexLocker locker(&mutex);
+  if (readyIsNew)
+    {
+      std::swap(front, ready);
+      readyIsNew = false;
+    }
+  return frames[front];
+}
+
+void
+RenderThread::run ()
+{
+  for (;;)
+    {
+      RenderState state;
+      int target;
+      {
+        QMutexLocker locker(&mutex);
+        while (!statePending && !stopping)
+          {
+            wake.wait(&mutex);
+          }
+        if (stopping)
+          {
+            return;
+          }
+        state = pendingState;
+        statePending = false;
+        target = back;
+      }
+
+      // Only this thread touches the back frame, so it is drawn without holding the lock.
+      RenderedFrame &frame = frames[target];
+      FrameBuffer &fb = frame.fb;
+      Profiler::beginFrame();
+      {
+        PROFILE_SCOPE(Clear);
+        fb.clear(QColor(0,0,0,0));
+        fb.clearDepthBuffer();
+        fb.setHiZEnabled(state.hiZ);
+      }
+
+      if (model.has_value())
+        {
+          drawModel(state, fb);
+        }
+      else
+        {
+          drawShapes(state, fb);
+        }
+
+#ifdef TINYRENDERER_PROFILING
+      Profiler::countCoveredPixels(fb);
+#endif
+      // The depth map is converted here rather than when the window paints.
+      frame.depthMap = fb.depthMap();
+      frame.profile = Profiler::endFrame();
+
+      {
+        QMutexLocker locker(&mutex);
+        std::swap(back, ready);
+        readyIsNew = true;
+      }
+      emit frameReady();
+    }
+}
+
+void
+RenderThread::drawShapes (const RenderState &state, FrameBuffer &fb)
+{
+  int ax =  7, ay =  3;
+  int bx = 12, by = 37;
+  int cx = 62, cy = 53;
+
+  if (state.drawTriangle)
+    {
+      fb.triangle({ax, ay}, {bx, by}, {cx, cy}, blue);
+    }
+  else if (state.drawTriangle2)
+    {
+      fb.triangle2({ax, ay}, {bx, by}, {cx, cy}, orange);
+    }
+  else if (state.drawTriangle3)
+    {
+      fb.triangle3({ax, ay}, {cx, cy}, {bx, by}, magenta);
+    }
+  else if (state.drawTriangle4)
+    {
+      fb.triangle4({ax, ay}, {50, 20}, {cx, cy}, magenta);
+      fb.triangle4({ax, ay}, {cx, cy}, {bx, by}, cyan);
+    }
+  else if (state.drawTriangle5)
+    {
+      fb.triangle5({ax, ay}, {50, 20}, {cx, cy}, magenta);
+      fb.triangle5({ax, ay}, {cx, cy}, {bx, by}, cyan);
+    }
+  else if (state.drawTriangle6)
+    {
+      fb.triangle6({ax, ay}, {50, 20}, {cx, cy}, magenta);
+      fb.triangle6({ax, ay}, {cx, cy}, {bx, by}, cyan);
+    }
+  else if (state.drawTriangle5Simd)
+    {
+      fb.triangle5simd({ax, ay}, {50, 20}, {cx, cy}, magenta);
+      fb.triangle5simd({ax, ay}, {cx, cy}, {bx, by}, cyan);
+    }
+
+  if (state.drawLines)
+    {
+      fb.line(ax, ay, bx, by, purple);
+      fb.line(cx, cy, bx, by, green);
+      fb.line(cx, cy, ax, ay, yellow);
+      fb.line(ax, ay, cx, cy, red);
+    }
+
+  if (state.drawPoints)
+    {
+      fb.set(ax, ay, white);
+      fb.set(bx, by, white);
+      fb.set(cx, cy, white);
+    }
+}
+
+void
+RenderThread::drawModel (const RenderState &state, FrameBuffer &fb)
+{
+  using Rasterizer = TileBinner::Rasterizer;
+  std::optional<Rasterizer> rasterizer;
+  if      (state.drawTriangle)  rasterizer = Rasterizer::Triangle;
+  else if (state.drawTriangle2) rasterizer = Rasterizer::Triangle2;
+  else if (state.drawTriangle3) rasterizer = Rasterizer::Triangle3;
+  else if (state.drawTriangle4) rasterizer = Rasterizer::Triangle4;
+  else if (state.drawTriangle5) rasterizer = Rasterizer::Triangle5;
+  else if (state.drawTriangle6) rasterizer = Rasterizer::Triangle6;
+  else if (state.drawTriangle5Simd) rasterizer = Rasterizer::Triangle5Simd;
+  else if (state.drawTriangleFixed) rasterizer = Rasterizer::TriangleFixed;
+
+  if (!rasterizer.has_value())
+    {
+      return;
+    }
+
+  RenderSettings settings;
+  settings.rasterizer = *rasterizer;
+  settings.depthTesting = state.depthTesting;
+  settings.samples = state.samples;
+  settings.backFaceCulling = state.backFaceCulling;
+  settings.shading = state.shading;
+  settings.deferred = state.deferred;
+  settings.depthPrepass = state.depthPrepass;
+  settings.shadows = state.shadows;
+  settings.shadowPcf = state.shadowPcf;
+  settings.lodSelection = state.lodSelection;
+  settings.zoom = state.zoom;
+  QQuaternion q = QQuaternion::fromAxisAndAngle(QVector3D(0,1,0), state.yRot);
+  renderer.draw(*model, q, settings, fb);
+}
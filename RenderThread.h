@@ -0,0 +1,100 @@
+#pragma once
+
+#include "FrameBuffer.h"
+#include "Model.h"
+#include "Profiler.h"
+#include "Renderer.h"
+
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <optional>
+
+// What the window wants drawn. Key presses edit the window's copy and post it to the render
+// thread.
+struct RenderState
+{
+  int yRot = 0;
+  // Size of the model relative to the window, from 1 down to 1/64.
+  float zoom = 1.0f;
+  bool lodSelection = true;
+  bool hiZ = true;
+
+  bool drawTriangle = false;
+  bool drawTriangle2 = true;
+  bool drawTriangle3 = false;
+  bool drawTriangle4 = false;
+  bool drawTriangle5 = false;
+  bool drawTriangle6 = false;
+  bool drawTriangle5Simd = false;
+  bool drawTriangleFixed = false;
+  bool drawLines = false;
+  bool drawPoints = false;
+
+  bool depthTesting = false;
+  int samples = 1;
+  bool backFaceCulling = true;
+  Shading shading = Shading::Flat;
+  bool deferred = false;
+  bool depthPrepass = false;
+  bool shadows = false;
+  bool shadowPcf = true;
+};
+
+// A finished frame, with everything the window needs to show it.
+struct RenderedFrame
+{
+  RenderedFrame(int width, int height) : fb(width, height) {}
+
+  FrameBuffer fb;
+  QImage depthMap;
+  Profiler::FrameProfile profile;
+};
+
+// Draws frames on its own thread, so that a slow frame never blocks the window.
+//
+// There are three frames: the render thread draws into the back one, the window shows the front
+// one, and the third holds the latest finished frame until the window takes it. Neither side ever
+// waits for the other, and the window always gets the newest frame.
+class RenderThread : public QThread
+{
+  Q_OBJECT
+
+public:
+  RenderThread(int width, int height, std::optional<Model> model, QObject *parent = nullptr);
+  ~RenderThread() override;
+
+  // Asks for a frame of state. When states come faster than frames, only the last one is drawn.
+  void post(const RenderState &state);
+  // Stops after the frame being drawn, if any.
+  void stop();
+
+  // The latest finished frame, or a blank one before the first. For the GUI thread only; the
+  // frame stays untouched until the next call.
+  const RenderedFrame &latestFrame();
+
+signals:
+  // A new frame is ready for latestFrame(). Emitted from the render thread.
+  void frameReady();
+
+protected:
+  void run() override;
+
+private:
+  void drawShapes(const RenderState &state, FrameBuffer &fb);
+  void drawModel(const RenderState &state, FrameBuffer &fb);
+
+  std::optional<Model> model;
+  Renderer renderer;
+  RenderedFrame frames[3];
+
+  // Everything below is shared with the GUI thread and guarded by mutex.
+  QMutex mutex;
+  QWaitCondition wake;
+  int back = 0, ready = 1, front = 2;
+  bool readyIsNew = false;
+  RenderState pendingState;
+  bool statePending = false;
+  bool stopping = false;
+};
@@ -0,0 +1,293 @@
+#include "Renderer.h"
+#include "Profiler.h"
+#include "ShadowMap.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+// Appends the varyings of a clipped vertex, interpolated from the triangle's vertices with its
+// weights, and returns its entry.
+uint32_t appendVaryings(std::vector<float> &varyings, int count, const int (&triangle)[3],
+                        const Clipping::ClipVertex &v)
+{
+  size_t entry = varyings.size()/count;
+  varyings.resize(varyings.size() + count);
+  float *out = &varyings[entry*count];
+  for (int k = 0; k < count; k++)
+    {
+      out[k] = v.w[0]*varyings[size_t(triangle[0])*count + k] + v.w[1]*varyings[size_t(triangle[1])*count + k]
+             + v.w[2]*varyings[size_t(triangle[2])*count + k];
+    }
+  return entry;
+}
+}
+
+Renderer::Renderer(int width, int height)
+    : binner(width, height)
+{
+}
+
+Renderer::~Renderer() = default;
+
+RenderStats
+Renderer::draw(const Model &model, const QQuaternion &rotation, const RenderSettings &settings,
+               FrameBuffer &fb)
+{
+  bool shadows = settings.shadows && settings.rasterizer == TileBinner::Rasterizer::TriangleFixed
+                 && !settings.depthOnly;
+  switch (settings.shading)
+    {
+    case Shading::Flat:
+      break;
+    case Shading::VertexColors:
+      {
+        VertexColorShader shader;
+        return draw(model, rotation, settings, fb, ShaderProgram(shader, shader));
+      }
+    case Shading::Gouraud:
+      {
+        GouraudShader shader(rotation);
+        if (shadows)
+          {
+            Shadowed<GouraudShader> shadowed(shader, renderShadowMap(model, shader.light, settings), settings.shadowPcf);
+            return draw(model, rotation, settings, fb, ShaderProgram(shadowed, shadowed));
+          }
+        return draw(model, rotation, settings, fb, ShaderProgram(shader, shader));
+      }
+    case Shading::Phong:
+      {
+        PhongShader shader(rotation);
+        if (shadows)
+          {
+            Shadowed<PhongShader> shadowed(shader, renderShadowMap(model, shader.light, settings), settings.shadowPcf);
+            return draw(model, rotation, settings, fb, ShaderProgram(shadowed, shadowed));
+          }
+        return draw(model, rotation, settings, fb, ShaderProgram(shader, shader));
+      }
+    }
+  return draw(model, rotation, settings, fb, ShaderProgram(RasterPipeline::flatShader, RasterPipeline::flatShader));
+}
+
+RenderStats
+Renderer::draw(const Model &model, const QQuaternion &rotation, const RenderSettings &settings,
+               FrameBuffer &fb, const ShaderProgram &program)
+{
+  using Rasterizer = TileBinner::Rasterizer;
+  Rasterizer rasterizer = settings.rasterizer;
+  bool fixedPoint = rasterizer == Rasterizer::TriangleFixed;
+  bool depthOnly = fixedPoint && settings.depthOnly;
+  int varyingCount = fixedPoint && !depthOnly ? program.varyings() : 0;
+  RasterPipeline::State pipeline;
+  if (fixedPoint)
+    {
+      using namespace RasterPipeline;
+      pipeline.cull = settings.backFaceCulling ? Cull::Back : Cull::None;
+      pipeline.depth = settings.depthTesting ? Depth::TestWrite : Depth::Off;
+      pipeline.samples = settings.samples == 4 || settings.samples == 8 ? settings.samples : 1;
+      pipeline.output = settings.deferred ? Output::GBuffer : Output::Color;
+      pipeline.depthPrepass = settings.depthPrepass;
+      if (depthOnly)
+        {
+          pipeline.depth = Depth::TestWrite;
+          pipeline.samples = 1;
+          pipeline.output = Output::DepthOnly;
+          pipeline.depthPrepass = false;
+        }
+      if (pipeline.output == Output::GBuffer)
+        {
+          fb.enableGBuffer();
+        }
+    }
+  else if (settings.depthTesting)
+    {
+      rasterizer = Rasterizer::Triangle3z;
+    }
+  binner.begin(rasterizer, pipeline, program.fragmentStage());
+  if (binner.samples() > 1)
+    {
+      fb.enableMultisampling(binner.samples());
+    }
+
+  // The smaller the model is on screen, the coarser the LOD that still looks the same. A LOD only
+  // uses the first vertices of the model, so the others aren't transformed at all.
+  int lod = 0;
+  if (settings.lodSelection)
+    {
+      float screenRadius = model.boundingRadius()*settings.zoom*std::max(fb.width(), fb.height())/2.0f;
+      lod = model.selectLod(screenRadius);
+    }
+  ArrayView<ModelLod> lods = model.lods();
+  ArrayView<QVector3D> vertices = model.vertices().sliced(0, lods.isEmpty() ? 0 : lods[lod].vertexCount);
+
+  ArrayView<Meshlet> meshlets = model.meshlets(lod);
+  ArrayView<uint32_t> meshletVertices = model.meshletVertices();
+  ArrayView<uint8_t> meshletTriangles = model.meshletTriangles();
+  quint64 culled = 0, submitted = 0;
+
+  // Meshlets that are off the screen, or whose triangles all face away when the rasterizer culls
+  // back faces, are skipped before their vertices are transformed. The fixed-point rasterizers get
+  // 4 bits of sub-pixel precision.
+  {
+    PROFILE_SCOPE(VertexTransform);
+    VertexStage::Precision precision = fixedPoint ? VertexStage::Precision::Subpixel
+                                                  : VertexStage::Precision::Pixel;
+    if (program.writesPositions())
+      {
+        // Nothing is known of where the shader puts the vertices before it has run, so it runs on
+        // all of the LOD's and no meshlet is culled. The VertexStage then only maps its positions
+        // to the screen.
+        qsizetype count = vertices.size();
+        lodVertices.resize(count);
+        std::iota(lodVertices.begin(), lodVertices.end(), 0u);
+        clipPositions.resize(count);
+        varyings.resize(size_t(count)*program.varyings());
+        program.shadeVertices(model, {lodVertices.data(), count}, varyings.data(), clipPositions.data());
+        vertexStage.setup({clipPositions.data(), count}, QQuaternion(), 1, fb.width(), fb.height(),
+                          precision);
+        visibleMeshlets.clear();
+        for (const Meshlet &meshlet : meshlets)
+          {
+            visibleMeshlets.append(meshlet);
+          }
+        vertexStage.process(visibleMeshlets, meshletVertices);
+      }
+    else
+      {
+        vertexStage.setup(vertices, rotation, settings.zoom, fb.width(), fb.height(), precision);
+        bool cullBackFaces = binner.cullsBackFaces();
+        visibleMeshlets.clear();
+        for (const Meshlet &meshlet : meshlets)
+          {
+            if (vertexStage.meshletVisible(meshlet, cullBackFaces))
+              {
+                visibleMeshlets.append(meshlet);
+              }
+            else
+              {
+                culled += meshlet.triangleCount;
+              }
+          }
+
+        // The vertices of the visible meshlets are transformed and projected once, and the faces
+        // index into the results. The vertex shader runs on the same vertices.
+        vertexStage.process(visibleMeshlets, meshletVertices);
+        if (varyingCount > 0)
+          {
+            varyings.resize(size_t(vertices.size())*varyingCount);
+            program.shadeVertices(model, vertexStage.processedVertices(), varyings.data());
+          }
+      }
+  }
+
+  // Triangles are drawn meshlet by meshlet, in the order of the model's indices, so that the
+  // vertices of consecutive triangles are close together in the vertex stage's arrays.
+  {
+    PROFILE_SCOPE(TriangleSetup);
+    for (const Meshlet &meshlet : visibleMeshlets)
+      {
+        const uint32_t *localVertices = &meshletVertices[meshlet.vertexOffset];
+        const uint8_t *triangles = &meshletTriangles[3*meshlet.triangleOffset];
+        for (int t = 0; t < meshlet.triangleCount; t++)
+          {
+            int i0 = localVertices[triangles[3*t+0]];
+            int i1 = localVertices[triangles[3*t+1]];
+            int i2 = localVertices[triangles[3*t+2]];
+
+            QRgb c = indexColor(meshlet.triangleOffset + t);
+            unsigned code0 = vertexStage.outcode(i0);
+            unsigned code1 = vertexStage.outcode(i1);
+            unsigned code2 = vertexStage.outcode(i2);
+            if ((code0 & code1 & code2 & Clipping::OffScreen) != 0)
+              {
+                culled++;
+                continue; // all vertices beyond the same screen edge
+              }
+
+            // Triangles inside the guard band are only rasterized over their on-screen part. The
+            // others are clipped to the guard band first.
+            if (((code0 | code1 | code2) & Clipping::OutsideGuardBand) == 0)
+              {
+                if (fixedPoint)
+                  {
+                    binner.submit(vertexStage.vertexAt(i0), vertexStage.vertexAt(i1), vertexStage.vertexAt(i2), c,
+                                  i0, i1, i2);
+                  }
+                else
+                  {
+                    binner.submit(vertexStage.point3At(i0), vertexStage.point3At(i1), vertexStage.point3At(i2), c);
+                  }
+                submitted++;
+                continue;
+              }
+
+            // Vertices made by clipping get varyings of their own.
+            Clipping::ClipVertex polygon[Clipping::MAX_POLYGON_VERTICES];
+            uint32_t polygonVaryings[Clipping::MAX_POLYGON_VERTICES] = {};
+            int n = vertexStage.clipToGuardBand(i0, i1, i2, polygon);
+            if (varyingCount > 0)
+              {
+                for (int k = 0; k < n; k++)
+                  {
+                    polygonVaryings[k] = appendVaryings(varyings, varyingCount, {i0, i1, i2}, polygon[k]);
+                  }
+              }
+            for (int k = 1; k + 1 < n; k++)
+              {
+                if (fixedPoint)
+                  {
+                    binner.submit(Clipping::toVertex(polygon[0]), Clipping::toVertex(polygon[k]),
+                                  Clipping::toVertex(polygon[k+1]), c,
+                                  polygonVaryings[0], polygonVaryings[k], polygonVaryings[k+1]);
+                  }
+                else
+                  {
+                    binner.submit(Clipping::toPoint3(polygon[0]), Clipping::toPoint3(polygon[k]),
+                                  Clipping::toPoint3(polygon[k+1]), c);
+                  }
+                submitted++;
+              }
+          }
+      }
+    PROFILE_COUNT(TrianglesCulled, culled);
+    PROFILE_COUNT(TrianglesSubmitted, submitted);
+  }
+
+  // Triangles are binned into screen tiles above, and the tiles are rasterized in parallel here.
+  {
+    PROFILE_SCOPE(Rasterization);
+    binner.flush(fb, varyings.data());
+  }
+  if (pipeline.output == RasterPipeline::Output::GBuffer)
+    {
+      PROFILE_SCOPE(Resolve);
+      binner.resolve(fb, varyings.data());
+    }
+  if (binner.samples() > 1)
+    {
+      PROFILE_SCOPE(Resolve);
+      binner.resolveSamples(fb);
+    }
+
+  RenderStats stats;
+  stats.lod = lod;
+  stats.triangles = model.indices(lod).size()/3;
+  stats.meshlets = meshlets.size();
+  stats.meshletsDrawn = visibleMeshlets.size();
+  stats.vertices = vertices.size();
+  stats.verticesTransformed = vertexStage.processedCount();
+  return stats;
+}
+
+const ShadowMap &
+Renderer::renderShadowMap(const Model &model, const Light &light, const RenderSettings &settings)
+{
+  PROFILE_SCOPE(ShadowMap);
+  if (!shadowMap)
+    {
+      shadowMap = std::make_unique<ShadowMap>();
+    }
+  shadowMap->render(model, light.direction, settings.lodSelection);
+  return *shadowMap;
+}
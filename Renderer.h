@@ -0,0 +1,169 @@
+#pragma once
+
+#include "FrameBuffer.h"
+#include "Model.h"
+#include "RasterPipeline.h"
+#include "Shader.h"
+#include "TileBinner.h"
+#include "VertexStage.h"
+
+#include <QQuaternion>
+#include <QVector>
+#include <memory>
+#include <vector>
+
+class ShadowMap;
+
+// The built-in shaders of Shader.h.
+enum class Shading
+{
+  Flat,         // a random color per triangle
+  VertexColors, // a random color per vertex, interpolated
+  Gouraud,
+  Phong,
+};
+
+// How a frame of a model is drawn.
+struct RenderSettings
+{
+  // One of Triangle to Triangle5Simd, or TriangleFixed. Depth testing on the former picks
+  // Triangle3z; TriangleFixed is the raster pipeline and combines all the options.
+  TileBinner::Rasterizer rasterizer = TileBinner::Rasterizer::Triangle3;
+  bool depthTesting = false;
+  // TriangleFixed only: 1, 4 or 8 samples per pixel. With more, every sample has a color and a
+  // depth of its own, and they are averaged into the pixels at the end of the draw.
+  int samples = 1;
+  bool backFaceCulling = true;
+  Shading shading = Shading::Flat;
+  // Writes a G-buffer and shades every visible pixel once afterwards, instead of every pixel that
+  // passes the depth test. Samples then only decide coverage.
+  bool deferred = false;
+  // TriangleFixed with depth testing and without multisampling: every tile is drawn depth only
+  // first, then shaded only where a triangle is the nearest. Each pixel is shaded once like
+  // deferred, without a G-buffer.
+  bool depthPrepass = false;
+  // Gouraud and Phong shading with TriangleFixed: the model casts shadows. A shadow map is drawn
+  // from the light before the frame, in its own profiler stage.
+  bool shadows = false;
+  // Shadow lookups filtered over 3x3 texels of the map (percentage-closer filtering), for soft
+  // edges instead of jagged ones.
+  bool shadowPcf = true;
+  // TriangleFixed only: the depth buffer is drawn and nothing else, no shader runs. For shadow
+  // maps and occlusion buffers.
+  bool depthOnly = false;
+  bool lodSelection = true;
+  // Size of the model relative to the frame.
+  float zoom = 1.0f;
+};
+
+struct RenderStats
+{
+  int lod;
+  qsizetype triangles;      // in the LOD
+  qsizetype meshlets;       // in the LOD
+  qsizetype meshletsDrawn;  // after culling
+  qsizetype vertices;       // in the LOD
+  qsizetype verticesTransformed;
+};
+
+// A vertex and a fragment shader (see Shader.h) with their types erased, so that the Renderer
+// doesn't have to be a template. The loops over vertices and pixels are still instantiated for
+// the shaders, so nothing is called through a pointer per vertex or per pixel. The shaders have
+// to outlive the program.
+class ShaderProgram
+{
+public:
+  template <typename VertexShader, typename FragmentShader>
+  ShaderProgram(const VertexShader &vertexShader, const FragmentShader &fragmentShader)
+      : varyingCount(VertexShader::VARYINGS), clipPositionsWritten(writesPosition<VertexShader>),
+        vertexShader(&vertexShader), shadeFunc(&shade<VertexShader>),
+        fragment(RasterPipeline::FragmentStage::of(fragmentShader))
+  {
+    static_assert(VertexShader::VARYINGS == FragmentShader::VARYINGS,
+                  "the fragment shader takes what the vertex shader writes");
+  }
+
+  int varyings() const { return varyingCount; }
+  // Whether the vertex shader returns the clip position of its vertices (see Shader.h).
+  bool writesPositions() const { return clipPositionsWritten; }
+  // Runs the vertex shader on the given vertices of model, in parallel. The varyings of vertex v
+  // go to out + v*varyings(), and its clip position to clipPositions[v] if writesPositions().
+  void shadeVertices(const Model &model, ArrayView<uint32_t> list, float *out,
+                     QVector3D *clipPositions = nullptr) const
+  {
+    shadeFunc(vertexShader, model, list, out, clipPositions);
+  }
+  const RasterPipeline::FragmentStage &fragmentStage() const { return fragment; }
+
+private:
+  template <typename VertexShader>
+  static void shade(const void *shader, const Model &model, ArrayView<uint32_t> list, float *out,
+                    QVector3D *clipPositions)
+  {
+    const VertexShader &vertexShader = *static_cast<const VertexShader*>(shader);
+    constexpr int VARYINGS = VertexShader::VARYINGS;
+    ArrayView<QVector3D> positions = model.vertices();
+    ArrayView<QVector3D> normals = model.normals();
+    ArrayView<QVector2D> texcoords = model.texcoords();
+    int n = list.size();
+#pragma omp parallel for schedule(static) if (n > 4096)
+    for (int i = 0; i < n; i++)
+      {
+        uint32_t v = list[i];
+        VertexInput in = {v, positions[v], normals.isEmpty() ? QVector3D() : normals[v],
+                          texcoords.isEmpty() ? QVector2D() : texcoords[v]};
+        if constexpr (writesPosition<VertexShader>)
+          {
+            clipPositions[v] = vertexShader(in, out + size_t(v)*VARYINGS);
+          }
+        else
+          {
+            vertexShader(in, out + size_t(v)*VARYINGS);
+          }
+      }
+  }
+
+  int varyingCount;
+  bool clipPositionsWritten;
+  const void *vertexShader;
+  void (*shadeFunc)(const void *shader, const Model &model, ArrayView<uint32_t> list, float *out,
+                    QVector3D *clipPositions);
+  RasterPipeline::FragmentStage fragment;
+};
+
+// Draws models into a frame buffer, without any window: the whole pipeline from the vertex stage
+// to the tile binner. Keeps its buffers from one frame to the next.
+class Renderer
+{
+public:
+  Renderer(int width, int height);
+  ~Renderer();
+
+  // Draws the model rotated by rotation on top of what is in fb, which must have the size given
+  // to the constructor. Clearing fb is up to the caller.
+  RenderStats draw(const Model &model, const QQuaternion &rotation, const RenderSettings &settings,
+                   FrameBuffer &fb);
+  // Same, shading with program instead of settings.shading and without shadows. Only
+  // TriangleFixed interpolates varyings and runs fragment shaders. A vertex shader that returns
+  // positions places the vertices for every rasterizer, and rotation and settings.zoom are then
+  // only used to pick the LOD.
+  RenderStats draw(const Model &model, const QQuaternion &rotation, const RenderSettings &settings,
+                   FrameBuffer &fb, const ShaderProgram &program);
+
+private:
+  // Draws the shadow map for light and returns it.
+  const ShadowMap &renderShadowMap(const Model &model, const Light &light, const RenderSettings &settings);
+
+  TileBinner binner;
+  VertexStage vertexStage;
+  // Meshlets of the current frame that survived culling.
+  QVector<Meshlet> visibleMeshlets;
+  // Written by the vertex shader at the index of every vertex, then those of clipped vertices.
+  std::vector<float> varyings;
+  // For vertex shaders that return positions: what they return, and the vertices of the LOD,
+  // which they all run on.
+  std::vector<QVector3D> clipPositions;
+  std::vector<uint32_t> lodVertices;
+  // Made on the first frame with shadows.
+  std::unique_ptr<ShadowMap> shadowMap;
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <QQuaternion>
+#include <QRgb>
+#include <QVector2D>
+#include <QVector3D>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// Programmable shading for the raster pipeline.
+//
+// A vertex shader runs once per vertex of the visible meshlets and writes VARYINGS floats. The
+// pipeline interpolates them across every triangle, and the fragment shader turns them into the
+// color of a pixel:
+//
+//   struct MyVertexShader
+//   {
+//     static constexpr int VARYINGS = 3;
+//     void operator()(const VertexInput &in, float *varyings) const;
+//   };
+//   struct MyFragmentShader
+//   {
+//     static constexpr int VARYINGS = 3;
+//     QRgb operator()(const FragmentInput &in, const float *varyings) const;
+//   };
+//
+// One type can be both, like the ones below. Their members are the uniforms. Shaders are template
+// arguments of the loops that run them, so they are inlined and cost nothing more than the
+// arithmetic they do.
+//
+// A vertex shader that places its vertices itself, for displacement, skinning or a projection of
+// its own, returns their clip position instead of void:
+//
+//   QVector3D operator()(const VertexInput &in, float *varyings) const;
+//
+// x and y are in [-1, 1] across the screen, y up, and z in [-1, 1], larger is closer: the model
+// rotated, with x and y times the zoom, is where the Renderer puts it. There is no w, the
+// projection is orthographic. Such shaders run before the VertexStage, which then maps their
+// positions to the screen, and no meshlet is culled, since the meshlet bounds say nothing about
+// the moved vertices. For the others, the VertexStage rotates the model and culls meshlets before
+// any shader runs.
+
+// Attributes of a model vertex. normal is that of the model (see Model::normals()), texcoord is
+// zero when the model has none.
+struct VertexInput
+{
+  uint32_t index;
+  QVector3D position;
+  QVector3D normal;
+  QVector2D texcoord;
+};
+
+template <typename VertexShader>
+using VertexShaderResult =
+    decltype(std::declval<const VertexShader&>()(std::declval<const VertexInput&>(), std::declval<float*>()));
+
+// Whether VertexShader returns the clip position of its vertices, see above.
+template <typename VertexShader>
+constexpr bool writesPosition = std::is_same_v<VertexShaderResult<VertexShader>, QVector3D>;
+
+// A pixel covered by a triangle, past the depth test. z is the depth in [0, 1], larger is closer,
+// and color the triangle's flat color.
+struct FragmentInput
+{
+  int x, y;
+  float z;
+  QRgb color;
+};
+
+// A random color that stays with the triangle (or vertex) whichever others are culled.
+inline QRgb indexColor(uint32_t index)
+{
+  uint32_t h = index*0x9e3779b1u;
+  h ^= h >> 15;
+  h *= 0x85ebca77u;
+  h ^= h >> 13;
+  return qRgba(h & 0xff, (h >> 8) & 0xff, (h >> 16) & 0xff, 255);
+}
+
+inline QRgb packColor(float r, float g, float b, float a)
+{
+  return qRgba(std::clamp(int(r + 0.5f), 0, 255), std::clamp(int(g + 0.5f), 0, 255),
+               std::clamp(int(b + 0.5f), 0, 255), std::clamp(int(a + 0.5f), 0, 255));
+}
+
+// The triangle's color, without varyings. The vertex shader does nothing.
+struct FlatShader
+{
+  static constexpr int VARYINGS = 0;
+
+  void operator()(const VertexInput&, float*) const {}
+  QRgb operator()(const FragmentInput &in, const float*) const { return in.color; }
+};
+
+// A random color per vertex, interpolated.
+struct VertexColorShader
+{
+  static constexpr int VARYINGS = 3;
+
+  void operator()(const VertexInput &in, float *out) const
+  {
+    QRgb c = indexColor(in.index);
+    out[0] = qRed(c);
+    out[1] = qGreen(c);
+    out[2] = qBlue(c);
+  }
+  QRgb operator()(const FragmentInput&, const float *v) const { return packColor(v[0], v[1], v[2], 255); }
+};
+
+// Lighting of the shaders below: one directional light, fixed relative to the viewer, above and
+// to the right of it. The uniforms are in model space, so the normals are used as they are.
+struct Light
+{
+  static constexpr float AMBIENT = 0.15f;
+  static constexpr float DIFFUSE = 0.85f;
+
+  QVector3D direction; // toward the light
+  QVector3D halfway;   // between the light and the viewer, for highlights
+  QRgb color = qRgba(220, 210, 195, 255);
+
+  explicit Light(const QQuaternion &rotation)
+  {
+    // The viewer looks along -z after the rotation.
+    QQuaternion toModel = rotation.conjugated();
+    direction = toModel.rotatedVector(QVector3D(0.4f, 0.6f, 1.0f).normalized());
+    halfway = (direction + toModel.rotatedVector(QVector3D(0, 0, 1))).normalized();
+  }
+
+  QRgb shade(float intensity, float highlight = 0) const
+  {
+    return packColor(qRed(color)*intensity + highlight, qGreen(color)*intensity + highlight,
+                     qBlue(color)*intensity + highlight, 255);
+  }
+};
+
+// Diffuse lighting per vertex, interpolated.
+//
+// The lit shaders also have shade(varyings, lit), with lit the fraction of the light that reaches
+// the pixel, for shadows (see ShadowMap.h).
+struct GouraudShader
+{
+  static constexpr int VARYINGS = 1;
+  Light light;
+
+  explicit GouraudShader(const QQuaternion &rotation) : light(rotation) {}
+
+  void operator()(const VertexInput &in, float *out) const
+  {
+    out[0] = std::max(0.0f, QVector3D::dotProduct(in.normal, light.direction));
+  }
+  QRgb operator()(const FragmentInput&, const float *v) const { return shade(v, 1); }
+  QRgb shade(const float *v, float lit) const { return light.shade(Light::AMBIENT + Light::DIFFUSE*v[0]*lit); }
+};
+
+// The normal interpolated, and diffuse and Blinn-Phong specular lighting per pixel.
+struct PhongShader
+{
+  static constexpr int VARYINGS = 3;
+  static constexpr float SPECULAR = 160.0f;
+  Light light;
+
+  explicit PhongShader(const QQuaternion &rotation) : light(rotation) {}
+
+  void operator()(const VertexInput &in, float *out) const
+  {
+    out[0] = in.normal.x();
+    out[1] = in.normal.y();
+    out[2] = in.normal.z();
+  }
+  QRgb operator()(const FragmentInput&, const float *v) const { return shade(v, 1); }
+  QRgb shade(const float *v, float lit) const
+  {
+    float length2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+    float scale = length2 > 0 ? 1/std::sqrt(length2) : 0;
+    const QVector3D &l = light.direction, &h = light.halfway;
+    float diffuse = std::max(0.0f, (v[0]*l.x() + v[1]*l.y() + v[2]*l.z())*scale);
+    float specular = std::max(0.0f, (v[0]*h.x() + v[1]*h.y() + v[2]*h.z())*scale);
+    // To the power 32.
+    for (int i = 0; i < 5; i++)
+      {
+        specular *= specular;
+      }
+    return light.shade(Light::AMBIENT + Light::DIFFUSE*diffuse*lit, SPECULAR*specular*lit);
+  }
+};
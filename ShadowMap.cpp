@@ -0,0 +1,39 @@
+#include "ShadowMap.h"
+
+namespace
+{
+// Depth bias, in texels of depth at 45 degrees, and how far points are moved along their normal
+// before the lookup, in texels.
+constexpr float BIAS_TEXELS = 1.0f;
+constexpr float NORMAL_OFFSET_TEXELS = 1.5f;
+}
+
+ShadowMap::ShadowMap(int size)
+    : size(size), fb(size, size, DepthFormat::Float32Reversed), renderer(size, size)
+{
+}
+
+void
+ShadowMap::render(const Model &model, const QVector3D &direction, bool lodSelection)
+{
+  // The light looks along -z after the rotation, like the viewer, and the model's bounding
+  // sphere fills the map. The sphere is around the center of the bounding box, which is near the
+  // origin for the models this draws.
+  rotation = QQuaternion::rotationTo(direction.normalized(), QVector3D(0, 0, 1));
+  zoom = model.boundingRadius() > 0 ? 1/model.boundingRadius() : 1;
+  // A texel is 2/(zoom*size) model units wide and depth is half the rotated z, so a 45 degree slope
+  // changes the depth by 1/(zoom*size) per texel.
+  bias = BIAS_TEXELS/(zoom*size);
+  normalOffset = NORMAL_OFFSET_TEXELS*2/(zoom*size);
+
+  fb.clearDepthBuffer();
+  RenderSettings settings;
+  settings.rasterizer = TileBinner::Rasterizer::TriangleFixed;
+  settings.depthTesting = true;
+  settings.depthOnly = true;
+  // Whatever faces away from the light still casts shadows when the mesh isn't closed.
+  settings.backFaceCulling = false;
+  settings.lodSelection = lodSelection;
+  settings.zoom = zoom;
+  renderer.draw(model, rotation, settings, fb);
+}
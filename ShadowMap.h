@@ -0,0 +1,112 @@
+#pragma once
+
+#include "FrameBuffer.h"
+#include "Model.h"
+#include "Renderer.h"
+#include "Shader.h"
+
+#include <QQuaternion>
+#include <QVector3D>
+#include <algorithm>
+#include <cmath>
+
+// The depth of a model seen from a directional light, for cast shadows.
+//
+// The map is drawn by a Renderer of its own in depth-only mode, so it goes through the same
+// meshlet culling, vertex stage, binner and depth-only kernels as a frame. The light looks at the
+// model orthographically, like the viewer, and the whole model is in the map whatever the view.
+class ShadowMap
+{
+public:
+  static constexpr int DEFAULT_SIZE = 1024;
+
+  explicit ShadowMap(int size = DEFAULT_SIZE);
+
+  // Draws the depth of model as seen from direction, which points toward the light in model
+  // space.
+  void render(const Model &model, const QVector3D &direction, bool lodSelection = true);
+
+  // Where a point of a surface with the given normal, in model space, is looked up in the map: x
+  // and y in pixels of the map, z the depth in [0, 1], larger is closer to the light. The point
+  // is moved off the surface along the normal first, so that surfaces at grazing angles to the
+  // light don't shadow themselves. Linear, so it can be interpolated across triangles.
+  QVector3D project(const QVector3D &p, const QVector3D &normal) const
+  {
+    QVector3D r = rotation.rotatedVector(p + normal*normalOffset);
+    return {(r.x()*zoom + 1)*size/2.0f, (r.y()*zoom + 1)*size/2.0f, (r.z() + 1)*0.5f};
+  }
+
+  // The fraction of the light that reaches a point given as project() does: 0 when something is
+  // nearer the light in the map, 1 when not. With pcf, the fraction of the 3x3 texels around it,
+  // for soft edges. Points outside the map are lit.
+  float visibility(const float *lightSpace, bool pcf) const
+  {
+    int x = int(std::floor(lightSpace[0] + 0.5f));
+    int y = int(std::floor(lightSpace[1] + 0.5f));
+    // Surfaces are nearer the light than their own depth in the map by up to a few texels' worth
+    // of their slope.
+    float z = lightSpace[2] + bias;
+    if (!pcf)
+      {
+        return lit(x, y, z) ? 1.0f : 0.0f;
+      }
+    int count = 0;
+    for (int dy = -1; dy <= 1; dy++)
+      {
+        for (int dx = -1; dx <= 1; dx++)
+          {
+            count += lit(x + dx, y + dy, z);
+          }
+      }
+    return count/9.0f;
+  }
+
+  const FrameBuffer &depthBuffer() const { return fb; }
+
+private:
+  bool lit(int x, int y, float z) const
+  {
+    if (x < 0 || y < 0 || x >= size || y >= size)
+      {
+        return true;
+      }
+    return z >= fb.depthRow<float>(y)[x];
+  }
+
+  int size;
+  // Float32Reversed, which stores z itself: nothing to decode in the lookups.
+  FrameBuffer fb;
+  Renderer renderer;
+  QQuaternion rotation;
+  float zoom = 1;
+  float bias = 0;
+  float normalOffset = 0;
+};
+
+// A lit shader of Shader.h (GouraudShader or PhongShader) whose light is blocked where the shadow
+// map has something nearer to it. The light-space position is added to the varyings; the light
+// is orthographic, so interpolating it is exact. The map has to be rendered for the shader's
+// light, and to outlive it.
+template <typename LitShader>
+struct Shadowed : LitShader
+{
+  static constexpr int VARYINGS = LitShader::VARYINGS + 3;
+  const ShadowMap *shadowMap;
+  bool pcf;
+
+  Shadowed(const LitShader &shader, const ShadowMap &shadowMap, bool pcf)
+      : LitShader(shader), shadowMap(&shadowMap), pcf(pcf) {}
+
+  void operator()(const VertexInput &in, float *out) const
+  {
+    LitShader::operator()(in, out);
+    QVector3D p = shadowMap->project(in.position, in.normal);
+    out[LitShader::VARYINGS + 0] = p.x();
+    out[LitShader::VARYINGS + 1] = p.y();
+    out[LitShader::VARYINGS + 2] = p.z();
+  }
+  QRgb operator()(const FragmentInput&, const float *v) const
+  {
+    return LitShader::shade(v, shadowMap->visibility(v + LitShader::VARYINGS, pcf));
+  }
+};
@@ -0,0 +1,370 @@
+#include "Simplify.h"
+#include "IndexOrder.h"
+#include "Model.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+#include <queue>
+
+namespace
+{
+// Boundary edges are kept in place by planes through them, perpendicular to their triangle, that
+// weigh this much more than the triangles.
+constexpr double BOUNDARY_WEIGHT = 10;
+
+// Collapses that cost the same, as on flat parts of the mesh, are taken shortest first, so that
+// the triangles stay evenly sized instead of fanning out from a few vertices.
+constexpr double EDGE_LENGTH_BIAS = 1e-6;
+
+// LODs of a Model, including the full mesh, and the fewest triangles worth simplifying to.
+constexpr int MAX_LODS = 8;
+constexpr qsizetype MIN_LOD_TRIANGLES = 64;
+
+// The sum of squared distances to a set of planes, weighted: v^T Q v for v = (x, y, z, 1), with
+// the symmetric 4x4 matrix Q stored as its upper triangle.
+struct Quadric
+{
+  double a2 = 0, ab = 0, ac = 0, ad = 0;
+  double b2 = 0, bc = 0, bd = 0;
+  double c2 = 0, cd = 0;
+  double d2 = 0;
+  double weight = 0;
+
+  // The plane n.p + d = 0, with n of unit length.
+  void addPlane(const QVector3D &n, double d, double w)
+  {
+    double a = n.x(), b = n.y(), c = n.z();
+    a2 += w*a*a; ab += w*a*b; ac += w*a*c; ad += w*a*d;
+    b2 += w*b*b; bc += w*b*c; bd += w*b*d;
+    c2 += w*c*c; cd += w*c*d;
+    d2 += w*d*d;
+    weight += w;
+  }
+
+  Quadric &operator+=(const Quadric &q)
+  {
+    a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+    b2 += q.b2; bc += q.bc; bd += q.bd;
+    c2 += q.c2; cd += q.cd;
+    d2 += q.d2;
+    weight += q.weight;
+    return *this;
+  }
+
+  double evaluate(const QVector3D &p) const
+  {
+    double x = p.x(), y = p.y(), z = p.z();
+    return   a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x
+           + b2*y*y + 2*bc*y*z + 2*bd*y
+           + c2*z*z + 2*cd*z
+           + d2;
+  }
+};
+
+// Collapsing from onto to. The versions tell whether the quadrics have changed since the cost was
+// computed.
+struct Collapse
+{
+  double priority;
+  double cost;
+  uint32_t from, to;
+  uint32_t fromVersion, toVersion;
+
+  bool operator>(const Collapse &c) const { return priority > c.priority; }
+};
+
+class Simplifier
+{
+public:
+  Simplifier(ArrayView<QVector3D> vertices, IndexView indices)
+    : vertices(vertices), quadrics(vertices.size()), vertexTriangles(vertices.size()),
+      alive(vertices.size(), true), versions(vertices.size())
+  {
+    triangles.resize(indices.size()/3);
+    for (size_t t = 0; t < triangles.size(); t++)
+      {
+        triangles[t] = {indices[3*t], indices[3*t+1], indices[3*t+2]};
+        for (uint32_t v : triangles[t])
+          {
+            vertexTriangles[v].push_back(t);
+          }
+      }
+    triangleAlive.assign(triangles.size(), true);
+    liveTriangles = triangles.size();
+    addQuadrics();
+    for (uint32_t v = 0; v < vertices.size(); v++)
+      {
+        pushCollapses(v);
+      }
+  }
+
+  qsizetype triangleCount() const { return liveTriangles; }
+  double error() const { return maxError; }
+
+  // Collapses the cheapest edge that doesn't flip a triangle. Returns false when there is none.
+  bool collapseNext()
+  {
+    while (!queue.empty())
+      {
+        Collapse c = queue.top();
+        queue.pop();
+        if (!alive[c.from] || !alive[c.to] || versions[c.from] != c.fromVersion
+            || versions[c.to] != c.toVersion || flips(c.from, c.to))
+          {
+            continue;
+          }
+        collapse(c.from, c.to);
+        double weight = std::max(quadrics[c.to].weight, 1e-30);
+        maxError = std::max(maxError, std::sqrt(std::max(c.cost, 0.0)/weight));
+        return true;
+      }
+    return false;
+  }
+
+  QVector<uint32_t> indices() const
+  {
+    QVector<uint32_t> result;
+    result.reserve(3*liveTriangles);
+    for (size_t t = 0; t < triangles.size(); t++)
+      {
+        if (triangleAlive[t])
+          {
+            result.append(triangles[t][0]);
+            result.append(triangles[t][1]);
+            result.append(triangles[t][2]);
+          }
+      }
+    return result;
+  }
+
+private:
+  QVector3D normal(const std::array<uint32_t, 3> &t) const
+  {
+    const QVector3D &a = vertices[t[0]], &b = vertices[t[1]], &c = vertices[t[2]];
+    return QVector3D::crossProduct(b - a, c - a);
+  }
+
+  // Triangle planes weighted by area, and planes along the boundary edges.
+  void addQuadrics()
+  {
+    std::vector<std::array<uint32_t, 3>> edges; // vertices and triangle, smaller vertex first
+    for (size_t t = 0; t < triangles.size(); t++)
+      {
+        QVector3D n = normal(triangles[t]);
+        float length = n.length();
+        if (length == 0)
+          {
+            continue;
+          }
+        QVector3D unit = n/length;
+        double d = -QVector3D::dotProduct(unit, vertices[triangles[t][0]]);
+        for (uint32_t v : triangles[t])
+          {
+            quadrics[v].addPlane(unit, d, length/2);
+          }
+        for (int i = 0; i < 3; i++)
+          {
+            uint32_t a = triangles[t][i], b = triangles[t][(i+1)%3];
+            edges.push_back({std::min(a, b), std::max(a, b), (uint32_t)t});
+          }
+      }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size(); i++)
+      {
+        bool shared =    (i > 0 && edges[i-1][0] == edges[i][0] && edges[i-1][1] == edges[i][1])
+                      || (i + 1 < edges.size() && edges[i+1][0] == edges[i][0] && edges[i+1][1] == edges[i][1]);
+        if (shared)
+          {
+            continue;
+          }
+        const QVector3D &a = vertices[edges[i][0]], &b = vertices[edges[i][1]];
+        QVector3D edge = b - a;
+        QVector3D n = QVector3D::crossProduct(edge, normal(triangles[edges[i][2]])).normalized();
+        double d = -QVector3D::dotProduct(n, a);
+        double w = BOUNDARY_WEIGHT*edge.lengthSquared();
+        quadrics[edges[i][0]].addPlane(n, d, w);
+        quadrics[edges[i][1]].addPlane(n, d, w);
+      }
+  }
+
+  // Queues the cheaper direction of every edge of v.
+  void pushCollapses(uint32_t v)
+  {
+    for (uint32_t t : vertexTriangles[v])
+      {
+        if (!triangleAlive[t])
+          {
+            continue;
+          }
+        for (uint32_t u : triangles[t])
+          {
+            if (u == v)
+              {
+                continue;
+              }
+            Quadric q = quadrics[u];
+            q += quadrics[v];
+            double toU = q.evaluate(vertices[u]), toV = q.evaluate(vertices[v]);
+            double bias = EDGE_LENGTH_BIAS*q.weight*(vertices[u] - vertices[v]).lengthSquared();
+            if (toV <= toU)
+              {
+                queue.push({toV + bias, toV, u, v, versions[u], versions[v]});
+              }
+            else
+              {
+                queue.push({toU + bias, toU, v, u, versions[v], versions[u]});
+              }
+          }
+      }
+  }
+
+  // Whether moving from onto to turns a triangle of from around, or makes it degenerate.
+  bool flips(uint32_t from, uint32_t to) const
+  {
+    for (uint32_t t : vertexTriangles[from])
+      {
+        const std::array<uint32_t, 3> &corners = triangles[t];
+        if (!triangleAlive[t] || std::find(corners.begin(), corners.end(), to) != corners.end())
+          {
+            continue;
+          }
+        std::array<uint32_t, 3> moved = corners;
+        std::replace(moved.begin(), moved.end(), from, to);
+        QVector3D before = normal(corners), after = normal(moved);
+        if (QVector3D::dotProduct(before, after) <= 0)
+          {
+            return true;
+          }
+      }
+    return false;
+  }
+
+  void collapse(uint32_t from, uint32_t to)
+  {
+    for (uint32_t t : vertexTriangles[from])
+      {
+        if (!triangleAlive[t])
+          {
+            continue;
+          }
+        std::array<uint32_t, 3> &corners = triangles[t];
+        if (std::find(corners.begin(), corners.end(), to) != corners.end())
+          {
+            triangleAlive[t] = false;
+            liveTriangles--;
+            continue;
+          }
+        std::replace(corners.begin(), corners.end(), from, to);
+        vertexTriangles[to].push_back(t);
+      }
+    std::vector<uint32_t> &list = vertexTriangles[to];
+    list.erase(std::remove_if(list.begin(), list.end(), [this](uint32_t t) { return !triangleAlive[t]; }),
+               list.end());
+    vertexTriangles[from].clear();
+    alive[from] = false;
+    quadrics[to] += quadrics[from];
+    versions[to]++;
+    pushCollapses(to);
+  }
+
+  ArrayView<QVector3D> vertices;
+  std::vector<Quadric> quadrics;
+  std::vector<std::array<uint32_t, 3>> triangles;
+  std::vector<bool> triangleAlive;
+  std::vector<std::vector<uint32_t>> vertexTriangles;
+  std::vector<bool> alive;
+  std::vector<uint32_t> versions;
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+  qsizetype liveTriangles = 0;
+  double maxError = 0;
+};
+}
+
+std::vector<SimplifiedMesh>
+simplifyChain(ArrayView<QVector3D> vertices, IndexView indices, int maxLevels, qsizetype minTriangles)
+{
+  std::vector<SimplifiedMesh> chain;
+  Simplifier simplifier(vertices, indices);
+  qsizetype previous = simplifier.triangleCount();
+  while ((int)chain.size() < maxLevels && previous/2 >= minTriangles)
+    {
+      qsizetype target = previous/2;
+      bool stuck = false;
+      while (simplifier.triangleCount() > target && !stuck)
+        {
+          stuck = !simplifier.collapseNext();
+        }
+      // A level that saves less than a quarter of the triangles isn't worth keeping.
+      if (simplifier.triangleCount() > previous*3/4)
+        {
+          break;
+        }
+      previous = simplifier.triangleCount();
+      chain.push_back({simplifier.indices(), (float)simplifier.error()});
+      if (stuck)
+        {
+          break;
+        }
+    }
+  return chain;
+}
+
+void
+Model::generateLods()
+{
+  detach();
+  IndexView full = indices(0);
+  std::vector<QVector<uint32_t>> lodIndices(1, QVector<uint32_t>(full.size()));
+  for (qsizetype i = 0; i < full.size(); i++)
+    {
+      lodIndices[0][i] = full[i];
+    }
+  std::vector<float> errors = {0.0f};
+
+  // The simplified triangles are put in vertex cache order, like the full mesh.
+  for (SimplifiedMesh &mesh : simplifyChain(vertices(), full, MAX_LODS - 1, MIN_LOD_TRIANGLES))
+    {
+      QVector<uint32_t> reordered;
+      reordered.reserve(mesh.indices.size());
+      for (uint32_t t : optimizedTriangleOrder(vertices(), ArrayView<uint32_t>(mesh.indices)))
+        {
+          reordered.append(mesh.indices[3*t]);
+          reordered.append(mesh.indices[3*t+1]);
+          reordered.append(mesh.indices[3*t+2]);
+        }
+      lodIndices.push_back(std::move(reordered));
+      errors.push_back(boundsRadius > 0 ? mesh.error/boundsRadius : 0);
+    }
+
+  // Every LOD uses a subset of the vertices of the one before, so ordering the vertices by the
+  // coarsest LOD that uses them, and otherwise keeping their order, puts those of every LOD first.
+  int vertexCount = vertexData.size();
+  std::vector<int> coarsest(vertexCount, 0);
+  for (size_t lod = 1; lod < lodIndices.size(); lod++)
+    {
+      for (uint32_t v : lodIndices[lod])
+        {
+          coarsest[v] = lod;
+        }
+    }
+  std::vector<uint32_t> order(vertexCount);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&coarsest](uint32_t a, uint32_t b) { return coarsest[a] > coarsest[b]; });
+  std::vector<uint32_t> remap(vertexCount);
+  for (int i = 0; i < vertexCount; i++)
+    {
+      remap[order[i]] = i;
+    }
+  for (QVector<uint32_t> &indices : lodIndices)
+    {
+      for (uint32_t &v : indices)
+        {
+          v = remap[v];
+        }
+    }
+  renumberVertices(remap);
+  setLods(lodIndices, errors);
+}
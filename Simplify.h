@@ -0,0 +1,29 @@
+#pragma once
+
+#include "ArrayView.h"
+
+#include <QVector3D>
+#include <QVector>
+#include <cstdint>
+#include <vector>
+
+// Mesh simplification by quadric error edge collapse (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics", 1997).
+//
+// Edges are collapsed onto one of their vertices, never onto a new position, so a simplified mesh
+// is a new index list over a subset of the vertices, and keeps their attributes.
+
+struct SimplifiedMesh
+{
+  QVector<uint32_t> indices;
+  // Largest distance between the simplified and the original surface, estimated from the
+  // quadrics, in the units of the vertices.
+  float error;
+};
+
+// Simplifies the mesh in one pass and returns it every time the number of triangles has been
+// halved, up to maxLevels times or until it falls below minTriangles. Each mesh only uses vertices
+// used by the one before. Stops early when no more edges can be collapsed without flipping a
+// triangle.
+std::vector<SimplifiedMesh> simplifyChain(ArrayView<QVector3D> vertices, IndexView indices,
+                                          int maxLevels, qsizetype minTriangles);
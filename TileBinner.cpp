@@ -0,0 +1,219 @@
+#include "TileBinner.h"
+
+TileBinner::TileBinner(int width, int height)
+    : w(width), h(height),
+      tilesX((width + TILE_SIZE - 1)/TILE_SIZE),
+      tilesY((height + TILE_SIZE - 1)/TILE_SIZE),
+      bins(tilesX*tilesY)
+{
+}
+
+int
+TileBinner::tileCount() const
+{
+  return tilesX*tilesY;
+}
+
+void
+TileBinner::begin(Rasterizer r, const RasterPipeline::State &state, const RasterPipeline::FragmentStage &stage)
+{
+  rasterizer = r;
+  pipeline = state;
+  fragment = stage;
+  triangles.clear();
+  fixedTriangles.clear();
+  for (std::vector<uint32_t> &bin : bins)
+    {
+      bin.clear();
+    }
+}
+
+bool
+TileBinner::cullsBackFaces() const
+{
+  if (rasterizer == Rasterizer::TriangleFixed)
+    {
+      return pipeline.cull == RasterPipeline::Cull::Back;
+    }
+  return rasterizer != Rasterizer::Triangle && rasterizer != Rasterizer::Triangle2;
+}
+
+int
+TileBinner::samples() const
+{
+  if (rasterizer == Rasterizer::TriangleFixed)
+    {
+      return pipeline.output == RasterPipeline::Output::Color ? pipeline.samples : 1;
+    }
+  return rasterizer == Rasterizer::Triangle4 || rasterizer == Rasterizer::Triangle6 ? 4 : 1;
+}
+
+void
+TileBinner::submit(point3 p, point3 q, point3 r, QRgb c)
+{
+  int minx = std::min(std::min(p.x, q.x), r.x);
+  int maxx = std::max(std::max(p.x, q.x), r.x);
+  int miny = std::min(std::min(p.y, q.y), r.y);
+  int maxy = std::max(std::max(p.y, q.y), r.y);
+  addToBins(triangles.size(), minx, maxx, miny, maxy);
+  triangles.push_back({p, q, r, c});
+}
+
+void
+TileBinner::submit(vertex p, vertex q, vertex r, QRgb c, uint32_t vp, uint32_t vq, uint32_t vr)
+{
+  // Pixels whose center or samples may be covered; one extra pixel on each side is enough for
+  // the multisampling rasterizers.
+  int minx = (std::min(std::min(p.x, q.x), r.x) >> SUBPIXEL_BITS) - 1;
+  int maxx = (std::max(std::max(p.x, q.x), r.x) >> SUBPIXEL_BITS) + 1;
+  int miny = (std::min(std::min(p.y, q.y), r.y) >> SUBPIXEL_BITS) - 1;
+  int maxy = (std::max(std::max(p.y, q.y), r.y) >> SUBPIXEL_BITS) + 1;
+  addToBins(fixedTriangles.size(), minx, maxx, miny, maxy);
+  fixedTriangles.push_back({p, q, r, c, {vp, vq, vr}});
+}
+
+// Adds the triangle to every tile its bounding box touches.
+void
+TileBinner::addToBins(uint32_t index, int minx, int maxx, int miny, int maxy)
+{
+  minx = std::max(minx, 0);
+  maxx = std::min(maxx, w-1);
+  miny = std::max(miny, 0);
+  maxy = std::min(maxy, h-1);
+  if (minx > maxx || miny > maxy)
+    {
+      return; // entirely off-screen
+    }
+
+  for (int ty = miny/TILE_SIZE; ty <= maxy/TILE_SIZE; ty++)
+    {
+      for (int tx = minx/TILE_SIZE; tx <= maxx/TILE_SIZE; tx++)
+        {
+          bins[ty*tilesX + tx].push_back(index);
+        }
+    }
+}
+
+void
+TileBinner::flush(FrameBuffer &fb, const float *varyings)
+{
+  int tiles = tileCount();
+  // The pipeline's specializations are picked once for the whole draw. With a depth prepass, each
+  // tile is drawn depth only and then shaded where the depth is the nearest, while the tile's
+  // depth is still in the cache. Multisampled draws have none: the depth-only pass writes a depth
+  // per pixel, not per sample.
+  RasterPipeline::BinFunc prepassFunc = nullptr, pipelineFunc = nullptr;
+  if (rasterizer == Rasterizer::TriangleFixed)
+    {
+      using namespace RasterPipeline;
+      State state = pipeline;
+      if (pipeline.depthPrepass && pipeline.depth == Depth::TestWrite && pipeline.samples == 1)
+        {
+          State depthOnly = pipeline;
+          depthOnly.output = Output::DepthOnly;
+          prepassFunc = fragment.select(depthOnly, fb.depthFormat());
+          state.depth = Depth::Equal;
+        }
+      pipelineFunc = fragment.select(state, fb.depthFormat());
+    }
+  RasterPipeline::DrawData draw = {fixedTriangles.data(), varyings, fragment.shader};
+
+  // Tiles hold very different amounts of work, so hand them out dynamically.
+#pragma omp parallel for schedule(dynamic)
+  for (int tile = 0; tile < tiles; tile++)
+    {
+      rasterizeTile(fb, tile, prepassFunc, pipelineFunc, draw);
+    }
+}
+
+void
+TileBinner::resolve(FrameBuffer &fb, const float *varyings)
+{
+  int tiles = tileCount();
+  RasterPipeline::DrawData draw = {fixedTriangles.data(), varyings, fragment.shader};
+  // Only tiles that had triangles can have anything in the G-buffer.
+#pragma omp parallel for schedule(dynamic)
+  for (int tile = 0; tile < tiles; tile++)
+    {
+      if (!bins[tile].empty())
+        {
+          fragment.resolve(fb, draw, tileRect(tile));
+        }
+    }
+}
+
+void
+TileBinner::resolveSamples(FrameBuffer &fb)
+{
+  int tiles = tileCount();
+#pragma omp parallel for schedule(dynamic)
+  for (int tile = 0; tile < tiles; tile++)
+    {
+      if (!bins[tile].empty())
+        {
+          fb.resolveSamples(tileRect(tile));
+        }
+    }
+}
+
+rect
+TileBinner::tileRect(int tile) const
+{
+  int tx = tile % tilesX;
+  int ty = tile / tilesX;
+  return {tx*TILE_SIZE, ty*TILE_SIZE, std::min((tx+1)*TILE_SIZE, w) - 1, std::min((ty+1)*TILE_SIZE, h) - 1};
+}
+
+void
+TileBinner::rasterizeTile(FrameBuffer &fb, int tile, RasterPipeline::BinFunc prepassFunc,
+                          RasterPipeline::BinFunc pipelineFunc, const RasterPipeline::DrawData &draw) const
+{
+  const std::vector<uint32_t> &bin = bins[tile];
+  if (bin.empty())
+    {
+      return;
+    }
+
+  rect clip = tileRect(tile);
+
+  if (rasterizer == Rasterizer::TriangleFixed)
+    {
+      if (prepassFunc != nullptr)
+        {
+          prepassFunc(fb, draw, bin.data(), bin.size(), clip);
+        }
+      pipelineFunc(fb, draw, bin.data(), bin.size(), clip);
+      return;
+    }
+
+  switch (rasterizer)
+    {
+    case Rasterizer::Triangle:      rasterizeBin<&FrameBuffer::triangle>(fb, bin, clip);      break;
+    case Rasterizer::Triangle2:     rasterizeBin<&FrameBuffer::triangle2>(fb, bin, clip);     break;
+    case Rasterizer::Triangle3:     rasterizeBin<&FrameBuffer::triangle3>(fb, bin, clip);     break;
+    case Rasterizer::Triangle4:     rasterizeBin<&FrameBuffer::triangle4>(fb, bin, clip);     break;
+    case Rasterizer::Triangle5:     rasterizeBin<&FrameBuffer::triangle5>(fb, bin, clip);     break;
+    case Rasterizer::Triangle6:     rasterizeBin<&FrameBuffer::triangle6>(fb, bin, clip);     break;
+    case Rasterizer::Triangle5Simd: rasterizeBin<&FrameBuffer::triangle5simd>(fb, bin, clip); break;
+    case Rasterizer::Triangle3z:
+      for (uint32_t index : bin)
+        {
+          const Triangle &t = triangles[index];
+          fb.triangle3z(t.p, t.q, t.r, t.c, clip);
+        }
+      break;
+    case Rasterizer::TriangleFixed:
+      break;
+    }
+}
+
+template <void (FrameBuffer::*TriangleFunc)(point, point, point, QColor, const rect&)>
+void
+TileBinner::rasterizeBin(FrameBuffer &fb, const std::vector<uint32_t> &bin, const rect &clip) const
+{
+  for (uint32_t index : bin)
+    {
+      const Triangle &t = triangles[index];
+      (fb.*TriangleFunc)({t.p.x, t.p.y}, {t.q.x, t.q.y}, {t.r.x, t.r.y}, t.c, clip);
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "FrameBuffer.h"
+#include "RasterPipeline.h"
+
+#include <cstdint>
+#include <vector>
+
+// Sorts triangles into screen tiles and rasterizes the tiles in parallel.
+//
+// Each tile is rasterized by a single worker, clipped to the tile, and in submission order, so
+// the result is the same as drawing every triangle serially (including the multisampling
+// rasterizers and depth testing) and no two workers ever touch the same pixel.
+class TileBinner
+{
+public:
+  static constexpr int TILE_SIZE = 64;
+
+  enum class Rasterizer
+  {
+    Triangle,
+    Triangle2,
+    Triangle3,
+    Triangle3z,
+    Triangle4,
+    Triangle5,
+    Triangle6,
+    Triangle5Simd,
+    TriangleFixed, // the raster pipeline, with the state given to begin()
+  };
+
+  TileBinner(int width, int height);
+
+  // The fragment stage is only used by the pipeline.
+  void begin(Rasterizer rasterizer, const RasterPipeline::State &pipeline = {},
+             const RasterPipeline::FragmentStage &fragment = RasterPipeline::FragmentStage::of(RasterPipeline::flatShader));
+  // Whether the rasterizer given to begin() skips triangles that face away from the viewer.
+  // Triangle and Triangle2 draw both sides, the pipeline depends on its state.
+  bool cullsBackFaces() const;
+  // Samples per pixel that the rasterizer given to begin() draws into, in the frame buffer's
+  // samples: 4 for Triangle4 and Triangle6, the pipeline's for color draws. 1 when it draws into
+  // the pixels themselves.
+  int samples() const;
+
+  // Integer pixel vertices are for the original rasterizers, sub-pixel vertices for the
+  // pipeline. vp, vq and vr are the entries of the varyings at p, q and r.
+  void submit(point3 p, point3 q, point3 r, QRgb c);
+  void submit(vertex p, vertex q, vertex r, QRgb c, uint32_t vp = 0, uint32_t vq = 0, uint32_t vr = 0);
+  // varyings are those the submitted triangles refer to, for the fragment shader.
+  void flush(FrameBuffer &fb, const float *varyings = nullptr);
+  // After flush() of a deferred pipeline draw: shades the G-buffer, tile by tile in parallel.
+  void resolve(FrameBuffer &fb, const float *varyings = nullptr);
+  // After flush() of a draw with samples() > 1: averages the samples into the pixels, tile by
+  // tile in parallel. fb must have multisampling enabled with samples().
+  void resolveSamples(FrameBuffer &fb);
+
+  int tileCount() const;
+
+private:
+  struct Triangle
+  {
+    point3 p, q, r;
+    QRgb c;
+  };
+
+  void addToBins(uint32_t index, int minx, int maxx, int miny, int maxy);
+  rect tileRect(int tile) const;
+  void rasterizeTile(FrameBuffer &fb, int tile, RasterPipeline::BinFunc prepassFunc,
+                     RasterPipeline::BinFunc pipelineFunc, const RasterPipeline::DrawData &draw) const;
+  // The original rasterizers, one per instantiation, so that a bin makes direct calls.
+  template <void (FrameBuffer::*TriangleFunc)(point, point, point, QColor, const rect&)>
+  void rasterizeBin(FrameBuffer &fb, const std::vector<uint32_t> &bin, const rect &clip) const;
+
+  int w, h;
+  int tilesX, tilesY;
+  Rasterizer rasterizer = Rasterizer::Triangle3;
+  RasterPipeline::State pipeline;
+  RasterPipeline::FragmentStage fragment;
+  std::vector<Triangle> triangles;
+  std::vector<RasterPipeline::Triangle> fixedTriangles;
+  std::vector<std::vector<uint32_t>> bins;
+};
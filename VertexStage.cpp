@@ -0,0 +1,304 @@
+#include "VertexStage.h"
+#include "RasterKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VERTEX_STAGE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// Vertices per work item. Meshes with fewer vertices are processed on the calling thread.
+constexpr int CHUNK_SIZE = 16384;
+
+using Transform = VertexStage::Transform;
+
+// The arguments are positions as packed x, y, z floats, the range of vertices, and the output
+// arrays (indexed like the input). With a list, the range is of entries of the list instead.
+using TransformFunc = void (*)(const float *xyz, const uint32_t *list, int begin, int end,
+                               const Transform &t, int *x, int *y, float *z, quint8 *outcodes);
+
+// The screen position of a vertex, before rounding.
+Clipping::ClipVertex screenPosition(const Transform &t, float vx, float vy, float vz)
+{
+  float rx = t.m[0][0]*vx + t.m[0][1]*vy + t.m[0][2]*vz;
+  float ry = t.m[1][0]*vx + t.m[1][1]*vy + t.m[1][2]*vz;
+  float rz = t.m[2][0]*vx + t.m[2][1]*vy + t.m[2][2]*vz;
+  return {(rx + 1)*t.scaleX, (ry + 1)*t.scaleY, (rz + 1)*0.5f, {0, 0, 0}};
+}
+
+// A vertex is off an edge of the screen when it is more than a pixel past it, so that rounding
+// and sample offsets never reject a triangle that covers a pixel.
+unsigned vertexOutcode(const Transform &t, float sx, float sy)
+{
+  unsigned code = Clipping::outcode(sx, sy, -t.unit, -t.unit, t.screenMaxX + t.unit, t.screenMaxY + t.unit);
+  if (sx < t.minX || sx > t.maxX || sy < t.minY || sy > t.maxY)
+    {
+      code |= Clipping::OutsideGuardBand;
+    }
+  return code;
+}
+
+// Rounds like the vector path: floor(v + 0.5), after clamping to the guard band.
+void transformScalar(const float *xyz, const uint32_t *list, int begin, int end,
+                     const Transform &t, int *x, int *y, float *z, quint8 *outcodes)
+{
+  for (int n = begin; n < end; n++)
+    {
+      int i = list ? list[n] : n;
+      Clipping::ClipVertex v = screenPosition(t, xyz[3*i+0], xyz[3*i+1], xyz[3*i+2]);
+      outcodes[i] = vertexOutcode(t, v.x, v.y);
+      x[i] = std::floor(std::clamp(v.x, t.minX, t.maxX) + 0.5f);
+      y[i] = std::floor(std::clamp(v.y, t.minY, t.maxY) + 0.5f);
+      z[i] = v.z;
+    }
+}
+
+#ifdef VERTEX_STAGE_X86
+// 8 vertices at a time. The interleaved positions are split into components with gathers. Listed
+// vertices are gathered by index, and their results written back one by one.
+__attribute__((target("avx2")))
+void transformAvx2(const float *xyz, const uint32_t *list, int begin, int end,
+                   const Transform &t, int *x, int *y, float *z, quint8 *outcodes)
+{
+  constexpr int N = 8;
+  const __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256i three = _mm256_set1_epi32(3);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 scaleX = _mm256_set1_ps(t.scaleX);
+  const __m256 scaleY = _mm256_set1_ps(t.scaleY);
+  const __m256 minX = _mm256_set1_ps(t.minX);
+  const __m256 maxX = _mm256_set1_ps(t.maxX);
+  const __m256 minY = _mm256_set1_ps(t.minY);
+  const __m256 maxY = _mm256_set1_ps(t.maxY);
+  const __m256 screenMinX = _mm256_set1_ps(-t.unit);
+  const __m256 screenMaxX = _mm256_set1_ps(t.screenMaxX + t.unit);
+  const __m256 screenMinY = _mm256_set1_ps(-t.unit);
+  const __m256 screenMaxY = _mm256_set1_ps(t.screenMaxY + t.unit);
+  __m256 m[3][3];
+  for (int r = 0; r < 3; r++)
+    {
+      for (int c = 0; c < 3; c++)
+        {
+          m[r][c] = _mm256_set1_ps(t.m[r][c]);
+        }
+    }
+
+  int i = begin;
+  for (; i + N <= end; i += N)
+    {
+      const float *base = xyz + 3*i;
+      __m256i gather = offsets;
+      if (list)
+        {
+          base = xyz;
+          gather = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(list + i)), three);
+        }
+      __m256 vx = _mm256_i32gather_ps(base + 0, gather, 4);
+      __m256 vy = _mm256_i32gather_ps(base + 1, gather, 4);
+      __m256 vz = _mm256_i32gather_ps(base + 2, gather, 4);
+      __m256 r[3];
+      for (int k = 0; k < 3; k++)
+        {
+          r[k] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[k][0], vx), _mm256_mul_ps(m[k][1], vy)),
+                               _mm256_mul_ps(m[k][2], vz));
+        }
+      __m256 sx = _mm256_mul_ps(_mm256_add_ps(r[0], one), scaleX);
+      __m256 sy = _mm256_mul_ps(_mm256_add_ps(r[1], one), scaleY);
+
+      int left   = _mm256_movemask_ps(_mm256_cmp_ps(sx, screenMinX, _CMP_LT_OQ));
+      int right  = _mm256_movemask_ps(_mm256_cmp_ps(sx, screenMaxX, _CMP_GT_OQ));
+      int bottom = _mm256_movemask_ps(_mm256_cmp_ps(sy, screenMinY, _CMP_LT_OQ));
+      int top    = _mm256_movemask_ps(_mm256_cmp_ps(sy, screenMaxY, _CMP_GT_OQ));
+      __m256 guard = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(sx, minX, _CMP_LT_OQ), _mm256_cmp_ps(sx, maxX, _CMP_GT_OQ)),
+                                  _mm256_or_ps(_mm256_cmp_ps(sy, minY, _CMP_LT_OQ), _mm256_cmp_ps(sy, maxY, _CMP_GT_OQ)));
+      int outside = _mm256_movemask_ps(guard);
+      quint8 codes[N];
+      for (int k = 0; k < N; k++)
+        {
+          codes[k] =   ((left   >> k) & 1)*Clipping::Left   | ((right   >> k) & 1)*Clipping::Right
+                     | ((bottom >> k) & 1)*Clipping::Bottom | ((top     >> k) & 1)*Clipping::Top
+                     | ((outside >> k) & 1)*Clipping::OutsideGuardBand;
+        }
+
+      sx = _mm256_min_ps(_mm256_max_ps(sx, minX), maxX);
+      sy = _mm256_min_ps(_mm256_max_ps(sy, minY), maxY);
+      __m256i ix = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(sx, half)));
+      __m256i iy = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(sy, half)));
+      __m256 fz = _mm256_mul_ps(_mm256_add_ps(r[2], one), half);
+      if (list)
+        {
+          alignas(32) int lx[N], ly[N];
+          alignas(32) float lz[N];
+          _mm256_store_si256(reinterpret_cast<__m256i*>(lx), ix);
+          _mm256_store_si256(reinterpret_cast<__m256i*>(ly), iy);
+          _mm256_store_ps(lz, fz);
+          for (int k = 0; k < N; k++)
+            {
+              uint32_t v = list[i+k];
+              x[v] = lx[k];
+              y[v] = ly[k];
+              z[v] = lz[k];
+              outcodes[v] = codes[k];
+            }
+        }
+      else
+        {
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(x + i), ix);
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), iy);
+          _mm256_storeu_ps(z + i, fz);
+          std::copy(codes, codes + N, outcodes + i);
+        }
+    }
+  transformScalar(xyz, list, i, end, t, x, y, z, outcodes);
+}
+#endif
+
+TransformFunc transformFunc()
+{
+#ifdef VERTEX_STAGE_X86
+  if (RasterKernels::bestInstructionSet() >= RasterKernels::InstructionSet::AVX2)
+    {
+      return transformAvx2;
+    }
+#endif
+  return transformScalar;
+}
+
+// The rotation matrix of a unit quaternion, so that the result matches rotatedVector().
+void rotationMatrix(const QQuaternion &q, float m[3][3])
+{
+  float w = q.scalar(), x = q.x(), y = q.y(), z = q.z();
+  m[0][0] = 1 - 2*(y*y + z*z); m[0][1] = 2*(x*y - w*z);     m[0][2] = 2*(x*z + w*y);
+  m[1][0] = 2*(x*y + w*z);     m[1][1] = 1 - 2*(x*x + z*z); m[1][2] = 2*(y*z - w*x);
+  m[2][0] = 2*(x*z - w*y);     m[2][1] = 2*(y*z + w*x);     m[2][2] = 1 - 2*(x*x + y*y);
+}
+}
+
+void
+VertexStage::setup(ArrayView<QVector3D> vertices, const QQuaternion &rotation, float zoom,
+                   int width, int height, Precision precision)
+{
+  static_assert(sizeof(QVector3D) == 3*sizeof(float), "QVector3D is expected to be 3 packed floats");
+
+  if (vertices.size() != count)
+    {
+      count = vertices.size();
+      x = AlignedBuffer<int>(count);
+      y = AlignedBuffer<int>(count);
+      z = AlignedBuffer<float>(count);
+      outcodes = AlignedBuffer<quint8>(count);
+      stamps.assign(count, 0);
+      frame = 0;
+    }
+  source = vertices;
+
+  Transform &t = transform;
+  rotationMatrix(rotation.normalized(), t.m);
+  for (int c = 0; c < 3; c++)
+    {
+      t.m[0][c] *= zoom;
+      t.m[1][c] *= zoom;
+    }
+  t.zoom = zoom;
+  t.unit = precision == Precision::Subpixel ? SUBPIXEL_ONE : 1;
+  t.scaleX = width/2.0f*t.unit;
+  t.scaleY = height/2.0f*t.unit;
+  t.screenMaxX = (width - 1)*t.unit;
+  t.screenMaxY = (height - 1)*t.unit;
+  t.minX = -Clipping::GUARD_BAND*t.unit;
+  t.minY = -Clipping::GUARD_BAND*t.unit;
+  t.maxX = t.screenMaxX + Clipping::GUARD_BAND*t.unit;
+  t.maxY = t.screenMaxY + Clipping::GUARD_BAND*t.unit;
+}
+
+void
+VertexStage::transformVertices(const uint32_t *list, int n)
+{
+  static const TransformFunc transformRange = transformFunc();
+  const float *xyz = reinterpret_cast<const float*>(source.data());
+  int chunks = (n + CHUNK_SIZE-1)/CHUNK_SIZE;
+#pragma omp parallel for schedule(static) if (chunks > 1)
+  for (int chunk = 0; chunk < chunks; chunk++)
+    {
+      int begin = chunk*CHUNK_SIZE;
+      int end = std::min(begin + CHUNK_SIZE, n);
+      transformRange(xyz, list, begin, end, transform, x.data(), y.data(), z.data(), outcodes.data());
+    }
+}
+
+void
+VertexStage::process()
+{
+  vertexList.clear();
+  transformVertices(nullptr, count);
+  processed = count;
+}
+
+void
+VertexStage::process(ArrayView<Meshlet> meshlets, ArrayView<uint32_t> meshletVertices)
+{
+  // A vertex is listed once however many meshlets share it: it is stamped with the frame the
+  // first time it is seen.
+  if (++frame == 0)
+    {
+      std::fill(stamps.begin(), stamps.end(), 0);
+      frame = 1;
+    }
+  vertexList.clear();
+  for (const Meshlet &meshlet : meshlets)
+    {
+      for (uint32_t v : meshletVertices.sliced(meshlet.vertexOffset, meshlet.vertexCount))
+        {
+          if (stamps[v] != frame)
+            {
+              stamps[v] = frame;
+              vertexList.push_back(v);
+            }
+        }
+    }
+  transformVertices(vertexList.data(), vertexList.size());
+  processed = vertexList.size();
+}
+
+bool
+VertexStage::meshletVisible(const Meshlet &meshlet, bool cullBackFaces) const
+{
+  const Transform &t = transform;
+  // The viewer looks along -z after the rotation, so a triangle faces it when its rotated normal
+  // points to +z: every normal in the cone faces away when the axis is further than the cone's
+  // angle past perpendicular to the view.
+  if (cullBackFaces)
+    {
+      float facing = t.m[2][0]*meshlet.coneAxis[0] + t.m[2][1]*meshlet.coneAxis[1] + t.m[2][2]*meshlet.coneAxis[2];
+      if (facing < -meshlet.coneCutoff)
+        {
+          return false;
+        }
+    }
+
+  // Same bounds as the Left/Right/Bottom/Top outcodes.
+  Clipping::ClipVertex c = screenPosition(t, meshlet.center[0], meshlet.center[1], meshlet.center[2]);
+  float rx = meshlet.radius*t.zoom*t.scaleX;
+  float ry = meshlet.radius*t.zoom*t.scaleY;
+  return c.x + rx >= -t.unit && c.x - rx <= t.screenMaxX + t.unit
+      && c.y + ry >= -t.unit && c.y - ry <= t.screenMaxY + t.unit;
+}
+
+int
+VertexStage::clipToGuardBand(int i0, int i1, int i2, Clipping::ClipVertex *polygon) const
+{
+  int n = 0;
+  for (int i : {i0, i1, i2})
+    {
+      const QVector3D &v = source[i];
+      polygon[n] = screenPosition(transform, v.x(), v.y(), v.z());
+      polygon[n].w[n] = 1;
+      n++;
+    }
+  return Clipping::clipPolygon(polygon, n, transform.minX, transform.minY, transform.maxX, transform.maxY);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "AlignedBuffer.h"
+#include "ArrayView.h"
+#include "Clipping.h"
+#include "FrameBuffer.h"
+#include "Meshlet.h"
+
+#include <QQuaternion>
+#include <QVector3D>
+#include <cstdint>
+#include <vector>
+
+// Transforms and projects every vertex of a mesh, or of its visible meshlets, once per frame. The
+// results are kept as a structure of arrays in screen space, and triangle assembly looks them up
+// by index, so the cost of this stage depends on the number of vertices rather than the number of
+// faces.
+class VertexStage
+{
+public:
+  enum class Precision
+  {
+    Pixel,    // integer pixels, for the point3 rasterizers
+    Subpixel, // 28.4 fixed point, for the TriangleFixed rasterizers
+  };
+
+  // Sets up the rotation, the zoom (which scales x and y) and the mapping from [-1, 1] to the
+  // screen and of z to [0, 1] for the next process() calls. The vertices must stay alive until the
+  // next call, for process() and clipToGuardBand().
+  void setup(ArrayView<QVector3D> vertices, const QQuaternion &rotation, float zoom,
+             int width, int height, Precision precision);
+
+  // Transforms every vertex. Large meshes are split across threads, and the inner loop uses AVX2
+  // when the CPU has it.
+  void process();
+  // Transforms only the vertices used by the given meshlets, each once. The others keep stale
+  // results, so only these meshlets may be drawn.
+  void process(ArrayView<Meshlet> meshlets, ArrayView<uint32_t> meshletVertices);
+
+  // False when no triangle of the meshlet can cover a pixel, because the meshlet is off the
+  // screen or, with cullBackFaces, all its triangles face away from the viewer. Needs setup().
+  bool meshletVisible(const Meshlet &meshlet, bool cullBackFaces) const;
+
+  // Vertices transformed by the last process() call.
+  int processedCount() const { return processed; }
+  // Their indices after process(meshlets). Empty after process(), which transforms them all.
+  ArrayView<uint32_t> processedVertices() const { return {vertexList.data(), qsizetype(vertexList.size())}; }
+
+  int size() const { return count; }
+  point3 point3At(int i) const { return {x[i], y[i], z[i]}; }
+  vertex vertexAt(int i) const { return {x[i], y[i], z[i]}; }
+
+  const int *xs() const { return x.data(); }
+  const int *ys() const { return y.data(); }
+  const float *zs() const { return z.data(); }
+
+  // Clipping::Outcode bits of a vertex: where it is relative to the screen, and whether it is
+  // outside the guard band. The coordinates of vertices outside the guard band are clamped to
+  // it, so triangles using them have to go through clipToGuardBand() instead.
+  unsigned outcode(int i) const { return outcodes[i]; }
+
+  // Clips the triangle to the guard band and writes the polygon, in the stage's precision, to
+  // polygon (room for Clipping::MAX_POLYGON_VERTICES). Returns the number of vertices. Their
+  // weights are those of i0, i1 and i2.
+  int clipToGuardBand(int i0, int i1, int i2, Clipping::ClipVertex *polygon) const;
+
+  struct Transform
+  {
+    float m[3][3];        // rotation, with the zoom in the x and y rows
+    float zoom;
+    float scaleX, scaleY; // screen units per half of the [-1, 1] range
+    float minX, maxX;     // guard band, in screen units
+    float minY, maxY;
+    float screenMaxX;     // last pixel on the screen, in screen units
+    float screenMaxY;
+    float unit;           // screen units per pixel
+  };
+
+private:
+  void transformVertices(const uint32_t *list, int n);
+
+  int count = 0;
+  int processed = 0;
+  ArrayView<QVector3D> source;
+  Transform transform;
+  AlignedBuffer<int> x;
+  AlignedBuffer<int> y;
+  AlignedBuffer<float> z;
+  AlignedBuffer<quint8> outcodes;
+  // Last frame in which each vertex was listed by process(meshlets).
+  std::vector<uint32_t> stamps;
+  uint32_t frame = 0;
+  std::vector<uint32_t> vertexList;
+};
@@ -0,0 +1,529 @@
+// Measures every FrameBuffer primitive on its own, over sets of triangles of one shape, and whole
+// frames of a model through the Renderer, and reports throughput as text and JSON.
+//
+//   tinyrenderer-bench --model assets/diablo3_pose.obj --repetitions 10 --json results.json
+//
+// Every primitive draws the same triangles: line draws their outlines, and scanline fills them
+// with precomputed spans, so Mtris/s compares across primitives. Pixels are the area of the
+// triangles (or the length of the lines), not the pixels actually written. Primitives run on one
+// thread, straight into the frame buffer; model frames go through the tile binner on every core,
+// and are drawn once more with every built-in shader, with shadows and with multisampling, to show
+// what shading costs.
+
+#include "FrameBuffer.h"
+#include "Model.h"
+#include "RasterKernels.h"
+#include "Renderer.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+constexpr int PRIMITIVE_WIDTH = 1024;
+constexpr int PRIMITIVE_HEIGHT = 1024;
+
+// The results as text, on stderr when the JSON goes to stdout.
+FILE *table = stdout;
+
+struct Triangle
+{
+  point3 p, q, r; // pixels
+  vertex vp, vq, vr; // sub-pixels, for the fixed-point rasterizers
+  QRgb c;
+};
+
+struct Span
+{
+  int y, xleft, xright;
+  QRgb c;
+};
+
+struct Shape
+{
+  const char *name;
+  std::vector<Triangle> triangles;
+  std::vector<Span> spans; // filling the triangles row by row
+  double area;             // pixels covered by the triangles
+  double outline;          // pixels drawn by their outlines
+};
+
+struct Result
+{
+  std::string group; // "primitive", "model" or "shading"
+  std::string name;
+  std::string variant;
+  std::vector<double> ms;
+  double triangles;
+  double pixels;
+
+  double median() const
+  {
+    std::vector<double> sorted = ms;
+    std::sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    return n % 2 ? sorted[n/2] : (sorted[n/2 - 1] + sorted[n/2])/2;
+  }
+  double mean() const
+  {
+    double sum = 0;
+    for (double t : ms)
+      {
+        sum += t;
+      }
+    return sum/ms.size();
+  }
+  double stddev() const
+  {
+    double m = mean(), sum = 0;
+    for (double t : ms)
+      {
+        sum += (t - m)*(t - m);
+      }
+    return ms.size() > 1 ? std::sqrt(sum/(ms.size() - 1)) : 0;
+  }
+  double min() const { return *std::min_element(ms.begin(), ms.end()); }
+  // Per second, from the median.
+  double mtris() const { return triangles/median()/1e3; }
+  double mpixels() const { return pixels/median()/1e3; }
+};
+
+// Counter-clockwise in y-up coordinates, so that no rasterizer culls it.
+Triangle makeTriangle(std::mt19937 &rng, float px, float py, float qx, float qy, float rx, float ry)
+{
+  if ((qx - px)*(ry - py) - (qy - py)*(rx - px) < 0)
+    {
+      std::swap(qx, rx);
+      std::swap(qy, ry);
+    }
+  std::uniform_real_distribution<float> depth(0, 1);
+  std::uniform_int_distribution<int> channel(0, 255);
+  auto pixel = [&](float x, float y) { return point3{int(std::lround(x)), int(std::lround(y)), depth(rng)}; };
+  auto subpixel = [&](float x, float y, float z) {
+    return vertex{int(std::lround(x*SUBPIXEL_ONE)), int(std::lround(y*SUBPIXEL_ONE)), z};
+  };
+  Triangle t;
+  t.p = pixel(px, py);
+  t.q = pixel(qx, qy);
+  t.r = pixel(rx, ry);
+  t.vp = subpixel(px, py, t.p.z);
+  t.vq = subpixel(qx, qy, t.q.z);
+  t.vr = subpixel(rx, ry, t.r.z);
+  t.c = qRgba(channel(rng), channel(rng), channel(rng), 255);
+  return t;
+}
+
+void addSpans(Shape &shape, const Triangle &t)
+{
+  const point3 v[3] = {t.p, t.q, t.r};
+  int miny = std::min({t.p.y, t.q.y, t.r.y});
+  int maxy = std::max({t.p.y, t.q.y, t.r.y});
+  for (int y = miny; y <= maxy; y++)
+    {
+      float xleft = PRIMITIVE_WIDTH, xright = -1;
+      for (int e = 0; e < 3; e++)
+        {
+          const point3 &a = v[e], &b = v[(e+1) % 3];
+          if (a.y == b.y && a.y == y)
+            {
+              xleft = std::min({xleft, float(a.x), float(b.x)});
+              xright = std::max({xright, float(a.x), float(b.x)});
+            }
+          else if (a.y != b.y && std::min(a.y, b.y) <= y && y <= std::max(a.y, b.y))
+            {
+              float x = a.x + float(y - a.y)*(b.x - a.x)/(b.y - a.y);
+              xleft = std::min(xleft, x);
+              xright = std::max(xright, x);
+            }
+        }
+      int l = std::max(0, int(std::ceil(xleft))), r = std::min(PRIMITIVE_WIDTH - 1, int(std::floor(xright)));
+      if (l <= r && y >= 0 && y < PRIMITIVE_HEIGHT)
+        {
+          shape.spans.push_back({y, l, r, t.c});
+        }
+    }
+}
+
+Shape makeShape(const char *name, int count, std::mt19937 &rng,
+                const std::function<Triangle(std::mt19937&, int)> &generate)
+{
+  Shape shape{name, {}, {}, 0, 0};
+  for (int i = 0; i < count; i++)
+    {
+      Triangle t = generate(rng, i);
+      shape.triangles.push_back(t);
+      shape.area += std::abs(double(t.q.x - t.p.x)*(t.r.y - t.p.y) - double(t.q.y - t.p.y)*(t.r.x - t.p.x))/2;
+      for (auto [a, b] : {std::make_pair(t.p, t.q), std::make_pair(t.q, t.r), std::make_pair(t.r, t.p)})
+        {
+          shape.outline += std::max(std::abs(b.x - a.x), std::abs(b.y - a.y)) + 1;
+        }
+      addSpans(shape, t);
+    }
+  return shape;
+}
+
+std::vector<Shape> makeShapes()
+{
+  const float W = PRIMITIVE_WIDTH - 1, H = PRIMITIVE_HEIGHT - 1;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0, 1);
+  std::vector<Shape> shapes;
+
+  // Under 4 pixels: at most 3 pixels across.
+  shapes.push_back(makeShape("tiny", 100000, rng, [&](std::mt19937 &rng, int) {
+    float x = 2 + unit(rng)*(W - 6), y = 2 + unit(rng)*(H - 6);
+    return makeTriangle(rng, x, y, x + 1 + 2*unit(rng), y + unit(rng), x + unit(rng), y + 1 + 2*unit(rng));
+  }));
+  // Long and about a pixel wide, in any direction.
+  shapes.push_back(makeShape("sliver", 2000, rng, [&](std::mt19937 &rng, int) {
+    float angle = 2*float(M_PI)*unit(rng), length = 100 + 200*unit(rng);
+    float dx = std::cos(angle), dy = std::sin(angle);
+    float x = W/2 + (unit(rng) - 0.5f)*(W - 2*length), y = H/2 + (unit(rng) - 0.5f)*(H - 2*length);
+    return makeTriangle(rng, x, y, x + dx*length, y + dy*length,
+                        x + dx*length/2 - dy*1.5f, y + dy*length/2 + dx*1.5f);
+  }));
+  // Around 1000 pixels.
+  shapes.push_back(makeShape("medium", 5000, rng, [&](std::mt19937 &rng, int) {
+    float x = 50 + unit(rng)*(W - 100), y = 50 + unit(rng)*(H - 100);
+    auto corner = [&]() { return 45*(unit(rng) - 0.5f)*2; };
+    return makeTriangle(rng, x + corner(), y + corner(), x + corner(), y + corner(), x + corner(), y + corner());
+  }));
+  // Two triangles per screen.
+  shapes.push_back(makeShape("fullscreen", 8, rng, [&](std::mt19937 &rng, int i) {
+    return i % 2 ? makeTriangle(rng, 0, 0, W, 0, W, H) : makeTriangle(rng, 0, 0, W, H, 0, H);
+  }));
+  return shapes;
+}
+
+// Runs f once to warm up, then repetitions times after calling reset, and returns the times of
+// the timed runs.
+std::vector<double> measure(int repetitions, const std::function<void()> &reset,
+                            const std::function<void()> &f)
+{
+  std::vector<double> ms;
+  for (int i = -1; i < repetitions; i++)
+    {
+      reset();
+      QElapsedTimer timer;
+      timer.start();
+      f();
+      double elapsed = timer.nsecsElapsed()/1e6;
+      if (i >= 0)
+        {
+          ms.push_back(elapsed);
+        }
+    }
+  return ms;
+}
+
+std::vector<Result> benchmarkPrimitives(int repetitions, const QString &filter)
+{
+  using Draw = std::function<void(FrameBuffer&, const Shape&)>;
+  auto perTriangle = [](void (FrameBuffer::*f)(point, point, point, QColor)) -> Draw {
+    return [f](FrameBuffer &fb, const Shape &shape) {
+      for (const Triangle &t : shape.triangles)
+        {
+          (fb.*f)({t.p.x, t.p.y}, {t.q.x, t.q.y}, {t.r.x, t.r.y}, t.c);
+        }
+    };
+  };
+  auto perFixedTriangle = [](void (FrameBuffer::*f)(vertex, vertex, vertex, QColor)) -> Draw {
+    return [f](FrameBuffer &fb, const Shape &shape) {
+      for (const Triangle &t : shape.triangles)
+        {
+          (fb.*f)(t.vp, t.vq, t.vr, t.c);
+        }
+    };
+  };
+  const std::pair<const char*, Draw> primitives[] = {
+    {"triangle", perTriangle(&FrameBuffer::triangle)},
+    {"triangle2", perTriangle(&FrameBuffer::triangle2)},
+    {"triangle3", perTriangle(&FrameBuffer::triangle3)},
+    {"triangle3z", [](FrameBuffer &fb, const Shape &shape) {
+       for (const Triangle &t : shape.triangles)
+         {
+           fb.triangle3z(t.p, t.q, t.r, t.c);
+         }
+     }},
+    {"triangle4", perTriangle(&FrameBuffer::triangle4)},
+    {"triangle5", perTriangle(&FrameBuffer::triangle5)},
+    {"triangle5simd", perTriangle(&FrameBuffer::triangle5simd)},
+    {"triangle6", perTriangle(&FrameBuffer::triangle6)},
+    {"triangleFixed", perFixedTriangle(&FrameBuffer::triangleFixed)},
+    {"triangleFixedZ", perFixedTriangle(&FrameBuffer::triangleFixedZ)},
+    {"triangleFixed4x", perFixedTriangle(&FrameBuffer::triangleFixed4x)},
+    {"triangleFixedDepth", [](FrameBuffer &fb, const Shape &shape) {
+       for (const Triangle &t : shape.triangles)
+         {
+           fb.triangleFixedDepth(t.vp, t.vq, t.vr);
+         }
+     }},
+    {"line", [](FrameBuffer &fb, const Shape &shape) {
+       for (const Triangle &t : shape.triangles)
+         {
+           fb.line(t.p.x, t.p.y, t.q.x, t.q.y, t.c);
+           fb.line(t.q.x, t.q.y, t.r.x, t.r.y, t.c);
+           fb.line(t.r.x, t.r.y, t.p.x, t.p.y, t.c);
+         }
+     }},
+    {"scanline", [](FrameBuffer &fb, const Shape &shape) {
+       for (const Span &s : shape.spans)
+         {
+           fb.scanline(s.y, s.xleft, s.xright, s.c);
+         }
+     }},
+  };
+
+  std::vector<Shape> shapes = makeShapes();
+  FrameBuffer fb(PRIMITIVE_WIDTH, PRIMITIVE_HEIGHT);
+  std::vector<Result> results;
+  for (const auto &[name, draw] : primitives)
+    {
+      if (!filter.isEmpty() && !QString(name).startsWith(filter))
+        {
+          continue;
+        }
+      for (const Shape &shape : shapes)
+        {
+          Result r{"primitive", name, shape.name, {}, double(shape.triangles.size()),
+                   std::string(name) == "line" ? shape.outline : shape.area};
+          r.ms = measure(repetitions,
+                         [&]() { fb.clear(QColor(0, 0, 0, 0)); fb.clearDepthBuffer(); },
+                         [&]() { draw(fb, shape); });
+          results.push_back(r);
+          std::fprintf(table, "%-18s %-10s %9.3f ms  %10.4f Mtris/s  %9.2f Mpixels/s\n",
+                      name, shape.name, r.median(), r.mtris(), r.mpixels());
+        }
+    }
+  return results;
+}
+
+// Whole frames from FRAME_ANGLES directions per repetition, at full detail.
+std::vector<Result> benchmarkModel(const Model &model, int repetitions, const QString &filter)
+{
+  using Rasterizer = TileBinner::Rasterizer;
+  constexpr int FRAME_ANGLES = 8;
+  const QSize resolutions[] = {{320, 240}, {800, 800}, {1920, 1080}};
+  const struct { const char *name; Rasterizer rasterizer; bool depth; } modes[] = {
+    {"triangle3", Rasterizer::Triangle3, false},
+    {"triangle3z", Rasterizer::Triangle3, true},
+    {"triangleFixed", Rasterizer::TriangleFixed, false},
+    {"triangleFixedZ", Rasterizer::TriangleFixed, true},
+  };
+
+  std::vector<Result> results;
+  for (const QSize &size : resolutions)
+    {
+      FrameBuffer fb(size.width(), size.height());
+      Renderer renderer(size.width(), size.height());
+      for (const auto &mode : modes)
+        {
+          if (!filter.isEmpty() && !QString(mode.name).startsWith(filter))
+            {
+              continue;
+            }
+          RenderSettings settings;
+          settings.rasterizer = mode.rasterizer;
+          settings.depthTesting = mode.depth;
+          settings.lodSelection = false;
+          std::string variant = std::to_string(size.width()) + "x" + std::to_string(size.height());
+          Result r{"model", mode.name, variant, {}, 0, double(FRAME_ANGLES)*size.width()*size.height()};
+          r.ms = measure(repetitions, []() {}, [&]() {
+            r.triangles = 0;
+            for (int a = 0; a < FRAME_ANGLES; a++)
+              {
+                fb.clear(QColor(0, 0, 0, 0));
+                fb.clearDepthBuffer();
+                QQuaternion q = QQuaternion::fromAxisAndAngle(QVector3D(0,1,0), 360.0f*a/FRAME_ANGLES);
+                RenderStats stats = renderer.draw(model, q, settings, fb);
+                r.triangles += stats.triangles;
+              }
+          });
+          results.push_back(r);
+          std::fprintf(table, "%-16s %-10s %9.3f ms/frame  %10.4f Mtris/s  %9.2f Mpixels/s\n",
+                      mode.name, variant.c_str(), r.median()/FRAME_ANGLES, r.mtris(), r.mpixels());
+        }
+    }
+  return results;
+}
+
+// Whole frames like benchmarkModel, with the pipeline and depth testing, for every built-in
+// shader, forward, deferred and with a depth prepass. The overhead is relative to forward flat
+// shading, which has no varyings.
+std::vector<Result> benchmarkShading(const Model &model, int repetitions, const QString &filter)
+{
+  constexpr int FRAME_ANGLES = 8;
+  const QSize resolutions[] = {{800, 800}, {1920, 1080}};
+  const struct { const char *name; Shading shading; bool deferred, prepass, shadows, pcf; int samples; } modes[] = {
+    {"shadingFlat", Shading::Flat, false, false, false, false, 1},
+    {"shadingVertexColors", Shading::VertexColors, false, false, false, false, 1},
+    {"shadingGouraud", Shading::Gouraud, false, false, false, false, 1},
+    {"shadingPhong", Shading::Phong, false, false, false, false, 1},
+    {"shadingFlatDeferred", Shading::Flat, true, false, false, false, 1},
+    {"shadingVertexColorsDeferred", Shading::VertexColors, true, false, false, false, 1},
+    {"shadingGouraudDeferred", Shading::Gouraud, true, false, false, false, 1},
+    {"shadingPhongDeferred", Shading::Phong, true, false, false, false, 1},
+    {"shadingFlatPrepass", Shading::Flat, false, true, false, false, 1},
+    {"shadingVertexColorsPrepass", Shading::VertexColors, false, true, false, false, 1},
+    {"shadingGouraudPrepass", Shading::Gouraud, false, true, false, false, 1},
+    {"shadingPhongPrepass", Shading::Phong, false, true, false, false, 1},
+    {"shadingGouraudShadows", Shading::Gouraud, false, false, true, false, 1},
+    {"shadingPhongShadows", Shading::Phong, false, false, true, false, 1},
+    {"shadingPhongShadowsPcf", Shading::Phong, false, false, true, true, 1},
+    {"shadingFlatMsaa4x", Shading::Flat, false, false, false, false, 4},
+    {"shadingPhongMsaa4x", Shading::Phong, false, false, false, false, 4},
+    {"shadingFlatMsaa8x", Shading::Flat, false, false, false, false, 8},
+    {"shadingPhongMsaa8x", Shading::Phong, false, false, false, false, 8},
+  };
+
+  std::vector<Result> results;
+  for (const QSize &size : resolutions)
+    {
+      FrameBuffer fb(size.width(), size.height());
+      Renderer renderer(size.width(), size.height());
+      double flatMs = 0;
+      for (const auto &mode : modes)
+        {
+          if (!filter.isEmpty() && !QString(mode.name).startsWith(filter))
+            {
+              continue;
+            }
+          RenderSettings settings;
+          settings.rasterizer = TileBinner::Rasterizer::TriangleFixed;
+          settings.depthTesting = true;
+          settings.shading = mode.shading;
+          settings.deferred = mode.deferred;
+          settings.depthPrepass = mode.prepass;
+          settings.shadows = mode.shadows;
+          settings.shadowPcf = mode.pcf;
+          settings.samples = mode.samples;
+          settings.lodSelection = false;
+          std::string variant = std::to_string(size.width()) + "x" + std::to_string(size.height());
+          Result r{"shading", mode.name, variant, {}, 0, double(FRAME_ANGLES)*size.width()*size.height()};
+          r.ms = measure(repetitions, []() {}, [&]() {
+            r.triangles = 0;
+            for (int a = 0; a < FRAME_ANGLES; a++)
+              {
+                fb.clear(QColor(0, 0, 0, 0));
+                fb.clearDepthBuffer();
+                QQuaternion q = QQuaternion::fromAxisAndAngle(QVector3D(0,1,0), 360.0f*a/FRAME_ANGLES);
+                RenderStats stats = renderer.draw(model, q, settings, fb);
+                r.triangles += stats.triangles;
+              }
+          });
+          results.push_back(r);
+          bool baseline = mode.shading == Shading::Flat && !mode.deferred && !mode.prepass && !mode.shadows
+                          && mode.samples == 1;
+          if (baseline)
+            {
+              flatMs = r.median();
+            }
+          std::fprintf(table, "%-28s %-10s %9.3f ms/frame  %10.4f Mtris/s", mode.name, variant.c_str(),
+                       r.median()/FRAME_ANGLES, r.mtris());
+          if (flatMs > 0 && !baseline)
+            {
+              std::fprintf(table, "  %+6.1f%% over flat", (r.median()/flatMs - 1)*100);
+            }
+          std::fprintf(table, "\n");
+        }
+    }
+  return results;
+}
+
+bool writeJson(const QString &filename, const std::vector<Result> &results, int repetitions)
+{
+  std::string json = "{\n";
+  json += "  \"instruction_set\": \"" + std::string(RasterKernels::instructionSetName(RasterKernels::bestInstructionSet())) + "\",\n";
+  json += "  \"threads\": " + std::to_string(QThread::idealThreadCount()) + ",\n";
+  json += "  \"repetitions\": " + std::to_string(repetitions) + ",\n";
+  json += "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++)
+    {
+      const Result &r = results[i];
+      char line[512];
+      std::snprintf(line, sizeof line,
+                    "    {\"group\": \"%s\", \"name\": \"%s\", \"variant\": \"%s\", "
+                    "\"triangles\": %.0f, \"pixels\": %.0f, \"median_ms\": %.4f, \"mean_ms\": %.4f, "
+                    "\"min_ms\": %.4f, \"stddev_ms\": %.4f, \"mtris_per_s\": %.6g, \"mpixels_per_s\": %.6g}%s\n",
+                    r.group.c_str(), r.name.c_str(), r.variant.c_str(), r.triangles, r.pixels,
+                    r.median(), r.mean(), r.min(), r.stddev(), r.mtris(), r.mpixels(),
+                    i + 1 < results.size() ? "," : "");
+      json += line;
+    }
+  json += "  ]\n}\n";
+
+  if (filename == "-")
+    {
+      std::fputs(json.c_str(), stdout);
+      return true;
+    }
+  QFile file(filename);
+  return file.open(QIODevice::WriteOnly) && file.write(json.c_str(), json.size()) == qint64(json.size());
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("tinyrenderer-bench");
+  // Keeps what Model::load() reports about parsing out of the results.
+  QLoggingCategory::setFilterRules("tinyrenderer.model.info=false");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Measures the rasterizers on their own and on whole model frames.");
+  parser.addHelpOption();
+  QCommandLineOption modelOption({"m", "model"}, "OBJ file for the model frames, or none.", "file",
+                                 "assets/diablo3_pose.obj");
+  QCommandLineOption repetitionsOption({"n", "repetitions"}, "Timed runs of every benchmark.", "n", "10");
+  QCommandLineOption filterOption("filter", "Only primitives whose name starts with this.", "name");
+  QCommandLineOption jsonOption("json", "Writes the results as JSON, - for stdout.", "file");
+  parser.addOptions({modelOption, repetitionsOption, filterOption, jsonOption});
+  parser.process(app);
+
+  int repetitions = parser.value(repetitionsOption).toInt();
+  if (repetitions <= 0)
+    {
+      std::fprintf(stderr, "Invalid repetitions %s.\n", qPrintable(parser.value(repetitionsOption)));
+      return 1;
+    }
+  QString filter = parser.value(filterOption);
+  if (parser.value(jsonOption) == "-")
+    {
+      table = stderr;
+    }
+
+  std::vector<Result> results = benchmarkPrimitives(repetitions, filter);
+  QString modelFile = parser.value(modelOption);
+  if (modelFile != "none")
+    {
+      std::optional<Model> model = Model::load(modelFile, IndexOrder::Optimized);
+      if (!model.has_value())
+        {
+          std::fprintf(stderr, "Could not read %s.\n", qPrintable(modelFile));
+          return 1;
+        }
+      std::vector<Result> modelResults = benchmarkModel(*model, repetitions, filter);
+      results.insert(results.end(), modelResults.begin(), modelResults.end());
+      std::vector<Result> shadingResults = benchmarkShading(*model, repetitions, filter);
+      results.insert(results.end(), shadingResults.begin(), shadingResults.end());
+    }
+
+  if (parser.isSet(jsonOption) && !writeJson(parser.value(jsonOption), results, repetitions))
+    {
+      std::fprintf(stderr, "Could not write %s.\n", qPrintable(parser.value(jsonOption)));
+      return 1;
+    }
+  return 0;
+}
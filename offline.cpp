@@ -0,0 +1,304 @@
+// Renders a model from a list of camera angles into image files, without a window or a display,
+// and reports how long every frame took. For batch rendering on machines without an X server.
+//
+//   tinyrenderer-offline model.obj --size 1920x1080 --rasterizer fixed --depth
+//                        --angles 0,45,90:30 --orbit 360 --output frames --format png
+
+#include "FrameBuffer.h"
+#include "Model.h"
+#include "Profiler.h"
+#include "Renderer.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QTextStream>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+struct Camera
+{
+  float yaw;   // degrees around y, as the window's rotation
+  float pitch; // degrees around x, after the yaw
+};
+
+bool parseRasterizer(const QString &name, TileBinner::Rasterizer &rasterizer)
+{
+  using Rasterizer = TileBinner::Rasterizer;
+  static const std::pair<const char*, Rasterizer> names[] = {
+    {"triangle", Rasterizer::Triangle},   {"triangle2", Rasterizer::Triangle2},
+    {"triangle3", Rasterizer::Triangle3}, {"triangle4", Rasterizer::Triangle4},
+    {"triangle5", Rasterizer::Triangle5}, {"triangle6", Rasterizer::Triangle6},
+    {"triangle5simd", Rasterizer::Triangle5Simd}, {"fixed", Rasterizer::TriangleFixed},
+  };
+  for (const auto &[n, r] : names)
+    {
+      if (name == QLatin1String(n))
+        {
+          rasterizer = r;
+          return true;
+        }
+    }
+  return false;
+}
+
+bool parseShading(const QString &name, Shading &shading)
+{
+  static const std::pair<const char*, Shading> names[] = {
+    {"flat", Shading::Flat}, {"colors", Shading::VertexColors},
+    {"gouraud", Shading::Gouraud}, {"phong", Shading::Phong},
+  };
+  for (const auto &[n, s] : names)
+    {
+      if (name == QLatin1String(n))
+        {
+          shading = s;
+          return true;
+        }
+    }
+  return false;
+}
+
+// "yaw[:pitch],..." in degrees.
+bool parseAngles(const QString &list, std::vector<Camera> &cameras)
+{
+  for (const QString &angle : list.split(',', Qt::SkipEmptyParts))
+    {
+      QStringList parts = angle.split(':');
+      bool yawOk = false, pitchOk = true;
+      Camera camera = {parts[0].toFloat(&yawOk), 0};
+      if (parts.size() == 2)
+        {
+          camera.pitch = parts[1].toFloat(&pitchOk);
+        }
+      if (!yawOk || !pitchOk || parts.size() > 2)
+        {
+          return false;
+        }
+      cameras.push_back(camera);
+    }
+  return true;
+}
+
+double percentile(std::vector<double> values, double p)
+{
+  std::sort(values.begin(), values.end());
+  size_t i = std::min(values.size() - 1, size_t(p*values.size()));
+  return values[i];
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("tinyrenderer-offline");
+  // Parsing a model is reported at the info level, which is noise here. QT_LOGGING_RULES can
+  // turn it back on.
+  QLoggingCategory::setFilterRules("tinyrenderer.model.info=false");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Renders a model from a list of camera angles without a display.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("model", "OBJ file to render.");
+  QCommandLineOption sizeOption({"s", "size"}, "Frame size.", "WxH", "800x800");
+  QCommandLineOption rasterizerOption({"r", "rasterizer"},
+      "triangle, triangle2, triangle3, triangle4, triangle5, triangle6, triangle5simd or fixed.",
+      "name", "triangle3");
+  QCommandLineOption depthOption({"d", "depth"}, "Depth test (triangle3z or the fixed-point variant).");
+  QCommandLineOption multisampleOption("multisample", "Same as --samples 4.");
+  QCommandLineOption samplesOption("samples", "Samples per pixel, 1, 4 or 8, with the fixed rasterizer.",
+                                   "n", "1");
+  QCommandLineOption noCullOption("no-cull", "Draw back faces too, with the fixed rasterizer.");
+  QCommandLineOption shadingOption("shading", "flat, colors (per vertex), gouraud or phong, with the "
+                                   "fixed rasterizer.", "name", "flat");
+  QCommandLineOption deferredOption("deferred", "Shade through a G-buffer, each visible pixel once, "
+                                    "with the fixed rasterizer.");
+  QCommandLineOption prepassOption("depth-prepass", "Draw depth first, then shade each visible pixel "
+                                   "once, with the fixed rasterizer and --depth.");
+  QCommandLineOption shadowsOption("shadows", "Cast shadows, with gouraud or phong shading and the "
+                                   "fixed rasterizer.");
+  QCommandLineOption noPcfOption("no-pcf", "Hard shadow edges, without filtering the shadow map.");
+  QCommandLineOption anglesOption({"a", "angles"}, "Comma-separated camera angles in degrees.",
+                                  "yaw[:pitch],...");
+  QCommandLineOption orbitOption("orbit", "Adds n cameras evenly spaced around the y axis.", "n");
+  QCommandLineOption zoomOption({"z", "zoom"}, "Size of the model relative to the frame.", "zoom", "1");
+  QCommandLineOption noLodOption("no-lod", "Always draw the full-detail mesh.");
+  QCommandLineOption outputOption({"o", "output"}, "Directory for the images and the report.",
+                                  "dir", ".");
+  QCommandLineOption formatOption({"f", "format"}, "png, ppm, or none to only time the frames.",
+                                  "format", "png");
+  QCommandLineOption traceOption("trace", "Writes the stage timings of every frame as Chrome trace "
+                                 "events, in builds with profiling.", "file");
+  parser.addOptions({sizeOption, rasterizerOption, depthOption, multisampleOption, samplesOption,
+                     noCullOption, shadingOption, deferredOption, prepassOption, shadowsOption, noPcfOption, anglesOption,
+                     orbitOption, zoomOption, noLodOption, outputOption, formatOption, traceOption});
+  parser.process(app);
+
+  auto fail = [](const QString &message) {
+    std::fprintf(stderr, "%s\n", qPrintable(message));
+    return 1;
+  };
+
+  if (parser.positionalArguments().size() != 1)
+    {
+      return fail("Expected one model file. See --help.");
+    }
+  QStringList size = parser.value(sizeOption).split('x');
+  int width = 0, height = 0;
+  if (size.size() == 2)
+    {
+      width = size[0].toInt();
+      height = size[1].toInt();
+    }
+  if (width <= 0 || height <= 0)
+    {
+      return fail(QString("Invalid size %1.").arg(parser.value(sizeOption)));
+    }
+
+  RenderSettings settings;
+  if (!parseRasterizer(parser.value(rasterizerOption), settings.rasterizer))
+    {
+      return fail(QString("Unknown rasterizer %1.").arg(parser.value(rasterizerOption)));
+    }
+  settings.depthTesting = parser.isSet(depthOption);
+  settings.samples = parser.isSet(multisampleOption) ? 4 : parser.value(samplesOption).toInt();
+  if (settings.samples != 1 && settings.samples != 4 && settings.samples != 8)
+    {
+      return fail(QString("Invalid samples %1.").arg(parser.value(samplesOption)));
+    }
+  settings.backFaceCulling = !parser.isSet(noCullOption);
+  if (!parseShading(parser.value(shadingOption), settings.shading))
+    {
+      return fail(QString("Unknown shading %1.").arg(parser.value(shadingOption)));
+    }
+  settings.deferred = parser.isSet(deferredOption);
+  settings.depthPrepass = parser.isSet(prepassOption);
+  settings.shadows = parser.isSet(shadowsOption);
+  settings.shadowPcf = !parser.isSet(noPcfOption);
+  settings.lodSelection = !parser.isSet(noLodOption);
+  bool zoomOk = false;
+  settings.zoom = parser.value(zoomOption).toFloat(&zoomOk);
+  if (!zoomOk || settings.zoom <= 0)
+    {
+      return fail(QString("Invalid zoom %1.").arg(parser.value(zoomOption)));
+    }
+
+  std::vector<Camera> cameras;
+  if (parser.isSet(anglesOption) && !parseAngles(parser.value(anglesOption), cameras))
+    {
+      return fail(QString("Invalid angles %1.").arg(parser.value(anglesOption)));
+    }
+  if (parser.isSet(orbitOption))
+    {
+      int n = parser.value(orbitOption).toInt();
+      if (n <= 0)
+        {
+          return fail(QString("Invalid orbit %1.").arg(parser.value(orbitOption)));
+        }
+      for (int i = 0; i < n; i++)
+        {
+          cameras.push_back({360.0f*i/n, 0});
+        }
+    }
+  if (cameras.empty())
+    {
+      cameras.push_back({0, 0});
+    }
+
+  QString format = parser.value(formatOption).toLower();
+  if (format != "png" && format != "ppm" && format != "none")
+    {
+      return fail(QString("Unknown format %1.").arg(format));
+    }
+  QDir output(parser.value(outputOption));
+  if (!output.mkpath("."))
+    {
+      return fail(QString("Could not create %1.").arg(output.path()));
+    }
+
+  std::optional<Model> model = Model::load(parser.positionalArguments()[0], IndexOrder::Optimized);
+  if (!model.has_value())
+    {
+      return fail(QString("Could not read %1.").arg(parser.positionalArguments()[0]));
+    }
+
+  QFile reportFile(output.filePath("timings.csv"));
+  if (!reportFile.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+      return fail(QString("Could not write %1.").arg(reportFile.fileName()));
+    }
+  QTextStream report(&reportFile);
+  // shadow_ms is the part of render_ms spent on the shadow map, 0 in builds without profiling.
+  report << "frame,yaw,pitch,lod,triangles,meshlets,meshlets_drawn,vertices_transformed,render_ms,shadow_ms,write_ms\n";
+
+  FrameBuffer fb(width, height);
+  Renderer renderer(width, height);
+  std::vector<double> renderTimes;
+  QElapsedTimer total;
+  total.start();
+  for (size_t i = 0; i < cameras.size(); i++)
+    {
+      const Camera &camera = cameras[i];
+      QQuaternion rotation = QQuaternion::fromAxisAndAngle(QVector3D(1,0,0), camera.pitch)
+                             *QQuaternion::fromAxisAndAngle(QVector3D(0,1,0), camera.yaw);
+
+      Profiler::beginFrame();
+      QElapsedTimer timer;
+      timer.start();
+      {
+        PROFILE_SCOPE(Clear);
+        fb.clear(QColor(0,0,0,0));
+        fb.clearDepthBuffer();
+      }
+      RenderStats stats = renderer.draw(*model, rotation, settings, fb);
+      double renderMs = timer.nsecsElapsed()/1e6;
+      renderTimes.push_back(renderMs);
+#ifdef TINYRENDERER_PROFILING
+      Profiler::countCoveredPixels(fb);
+#endif
+
+      double writeMs = 0;
+      if (format != "none")
+        {
+          PROFILE_SCOPE(Present);
+          timer.restart();
+          QString path = output.filePath(QString("frame_%1.%2").arg(i, 5, 10, QChar('0')).arg(format));
+          if (!fb.qimage().save(path, format == "png" ? "PNG" : "PPM"))
+            {
+              return fail(QString("Could not write %1.").arg(path));
+            }
+          writeMs = timer.nsecsElapsed()/1e6;
+        }
+      Profiler::FrameProfile profile = Profiler::endFrame();
+      double shadowMs = profile.stageNs[int(Profiler::Stage::ShadowMap)]/1e6;
+
+      report << i << ',' << camera.yaw << ',' << camera.pitch << ',' << stats.lod << ','
+             << stats.triangles << ',' << stats.meshlets << ',' << stats.meshletsDrawn << ',' << stats.verticesTransformed << ','
+             << QString::number(renderMs, 'f', 3) << ',' << QString::number(shadowMs, 'f', 3) << ','
+             << QString::number(writeMs, 'f', 3) << '\n';
+    }
+
+  if (parser.isSet(traceOption) && !Profiler::writeChromeTrace(parser.value(traceOption)))
+    {
+      return fail(QString("Could not write %1.").arg(parser.value(traceOption)));
+    }
+
+  double sum = 0;
+  for (double t : renderTimes)
+    {
+      sum += t;
+    }
+  std::printf("%zu frames of %dx%d in %.1f s. Render time per frame: mean %.3f ms, median %.3f ms, "
+              "p95 %.3f ms, max %.3f ms.\n",
+              renderTimes.size(), width, height, total.elapsed()/1000.0, sum/renderTimes.size(),
+              percentile(renderTimes, 0.5), percentile(renderTimes, 0.95),
+              *std::max_element(renderTimes.begin(), renderTimes.end()));
+  return 0;
+}